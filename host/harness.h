@@ -0,0 +1,66 @@
+/*
+ * What the host tests share: the sketch, CHECK() and driving the sketch through time.
+ */
+#ifndef HOST_HARNESS_H
+#define HOST_HARNESS_H
+
+#include "sketch.h"
+
+static int hostFailures = 0;
+
+// report a failed condition and go on; main() returns hostResult()
+#define CHECK(condition) do { \
+		if (!(condition)) { \
+			printf("%s:%d: CHECK failed: %s\n", __FILE__, __LINE__, #condition); \
+			hostFailures++; \
+		} \
+	} while (0)
+
+inline int hostResult() {
+	if (hostFailures > 0) {
+		printf("%d check(s) failed\n", hostFailures);
+	}
+	return hostFailures > 0 ? 1 : 0;
+}
+
+// run body(result) in a child process with the sketch as it is now (simIsolated), so a test can boot
+// the sketch more than once; result has an int failures, which takes the checks failed in the child.
+// Returns false if the child failed.
+template <typename Result, typename Body>
+bool hostIsolated(Result &result, const Body &body) {
+	static const Body* run;
+	run = &body;
+	bool ok = simIsolated([](void* r) {
+		int before = hostFailures;
+		(*run)(*(Result*)r);
+		((Result*)r)->failures = hostFailures - before;
+	}, &result, sizeof(result));
+	hostFailures += result.failures;
+	return ok;
+}
+
+// run loop() until millis() reaches ms
+inline void hostRunUntil(unsigned long ms) {
+	while (millis() < ms) {
+		loop();
+	}
+}
+
+inline void hostRunFor(unsigned long ms) {
+	hostRunUntil(millis() + ms);
+}
+
+// press a button for ms and release it
+inline void hostPress(uint8_t pin, unsigned long ms = 200) {
+	simSetInput(pin, HIGH);
+	hostRunFor(ms);
+	simSetInput(pin, LOW);
+	hostRunFor(ms);
+}
+
+// the fan relay is ON when its input is LOW
+inline bool hostFanOn() {
+	return simOutput(relayFan) == LOW;
+}
+
+#endif
@@ -0,0 +1,20 @@
+# Declare the functions of the sketch before it is compiled, like the Arduino builder does,
+# so a function may be used above its definition.
+# cmake -DSKETCH=lcdDht.h -DOUTPUT=sketch_prototypes.h -P prototypes.cmake
+
+file(STRINGS "${SKETCH}" definitions
+	REGEX "^(void|bool|byte|int|long|unsigned long|unsigned int|float|char\\*|const char\\*) +[A-Za-z_0-9]+\\([^;]*\\) *\\{")
+
+set(prototypes "// generated from ${SKETCH} by prototypes.cmake\n")
+foreach(definition IN LISTS definitions)
+	string(REGEX REPLACE " *\\{.*$" ";" prototype "${definition}")
+	string(APPEND prototypes "${prototype}\n")
+endforeach()
+
+# do not touch the file when nothing has changed, so the tests are not rebuilt
+if(EXISTS "${OUTPUT}")
+	file(READ "${OUTPUT}" previous)
+endif()
+if(NOT "${previous}" STREQUAL "${prototypes}")
+	file(WRITE "${OUTPUT}" "${prototypes}")
+endif()
@@ -0,0 +1,40 @@
+/*
+ * A bathroom for the simulated sensor: a shower adds moisture, the fan takes the humid air out
+ * much faster than the leaks around the door do. Include after harness.h.
+ */
+#ifndef HOST_ROOM_H
+#define HOST_ROOM_H
+
+struct Room {
+	float outside = 45;         // % the air drifts back to
+	float showerRate = 6;       // % per minute a running shower adds
+	float fanRate = 0.25;       // share of the excess humidity the fan takes out per minute
+	float leakRate = 0.03;      // the same through the leaks
+	bool shower = false;
+	unsigned long time = 0;     // millis() of the last step
+	unsigned long fanTime = 0;  // millisecs the fan has run
+
+	// bring the humidity up to millis()
+	void step() {
+		unsigned long now = millis();
+		float minutes = (now - time) / 60000.0;
+		float excess = simHumidity - outside;
+
+		if (hostFanOn()) {
+			fanTime += now - time;
+		}
+		simHumidity += minutes * ((shower ? showerRate : 0) - (hostFanOn() ? fanRate : leakRate) * excess);
+		simHumidity = constrain(simHumidity, 0, 100);
+		time = now;
+	}
+
+	// run the sketch until millis() reaches ms
+	void runUntil(unsigned long ms) {
+		while (millis() < ms) {
+			step();
+			loop();
+		}
+	}
+};
+
+#endif
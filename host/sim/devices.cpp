@@ -0,0 +1,180 @@
+/*
+ * The devices behind the Arduino libraries: the HD44780 display, the DHT22, the EEPROM and Serial.
+ */
+#include <LiquidCrystal.h>
+#include <DHT.h>
+#include <EEPROM.h>
+
+#include "sim_internal.h"
+
+
+/* HD44780: DDRAM rows at 0x00 and 0x40 (40 characters each), 64 bytes of CGRAM */
+static uint8_t lcdDdram[128];
+static uint8_t lcdAddress = 0;
+static bool lcdToCgram = false;
+uint8_t simLcdCgram[64];
+unsigned long simLcdBusWrites = 0;
+
+// LiquidCrystal sends a byte as 2 nibbles and waits 100 micros after each
+const unsigned long lcdByteTime = 210;
+
+static void lcdSend(uint8_t value, bool data) {
+	simLcdBusWrites++;
+	simAdvance(lcdByteTime);
+
+	if (data) {
+		if (lcdToCgram) {
+			simLcdCgram[lcdAddress & 0x3F] = value;
+			lcdAddress = (lcdAddress + 1) & 0x3F;
+		}
+		else {
+			lcdDdram[lcdAddress & 0x7F] = value;
+			lcdAddress = (lcdAddress == 0x27) ? 0x40 : (lcdAddress == 0x67) ? 0x00 : lcdAddress + 1;
+		}
+	}
+	else if (value == 0x01) {
+		memset(lcdDdram, ' ', sizeof(lcdDdram));
+		lcdAddress = 0;
+		lcdToCgram = false;
+	}
+	else if (value == 0x02 || value == 0x03) {
+		lcdAddress = 0;
+		lcdToCgram = false;
+	}
+	else if (value & 0x80) {
+		lcdAddress = value & 0x7F;
+		lcdToCgram = false;
+	}
+	else if (value & 0x40) {
+		lcdAddress = value & 0x3F;
+		lcdToCgram = true;
+	}
+}
+
+std::string simLcdRow(uint8_t row) {
+	return std::string((const char*)lcdDdram + (row ? 0x40 : 0x00), 16);
+}
+
+void LiquidCrystal::begin(uint8_t cols, uint8_t rows) {
+	memset(lcdDdram, ' ', sizeof(lcdDdram));
+	simAdvance(50000);              // power-up wait
+	simAdvance(4500 + 4500 + 150);  // the 4-bit mode handshake
+	command(0x28);                  // 4-bit, 2 lines
+	command(0x0C);                  // display ON
+	clear();
+	command(0x06);                  // entry mode: increment
+}
+
+void LiquidCrystal::clear() {
+	command(0x01);
+	simAdvance(2000);
+}
+
+void LiquidCrystal::home() {
+	command(0x02);
+	simAdvance(2000);
+}
+
+void LiquidCrystal::setCursor(uint8_t col, uint8_t row) {
+	command(0x80 | (col + (row ? 0x40 : 0x00)));
+}
+
+void LiquidCrystal::createChar(uint8_t location, uint8_t charmap[]) {
+	command(0x40 | ((location & 7) << 3));
+	for (int i = 0; i < 8; i++) {
+		write(charmap[i]);
+	}
+}
+
+void LiquidCrystal::command(uint8_t value) {
+	lcdSend(value, false);
+}
+
+size_t LiquidCrystal::write(uint8_t value) {
+	lcdSend(value, true);
+	return 1;
+}
+
+
+/* DHT22 */
+float simHumidity = 50;
+float simTemperature = 21;
+bool simDhtFail = false;
+unsigned long simDhtReads = 0;
+void (*simSensorHook)() = 0;
+
+void DHT::begin() {
+	lastRead = millis() - 2000;
+}
+
+bool DHT::read(bool force) {
+	if (!force && millis() - lastRead < 2000) {
+		return lastResult;
+	}
+	lastRead = millis();
+	simDhtReads++;
+	if (simSensorHook) {
+		simSensorHook();
+	}
+
+	// the start signal with the interrupts enabled, then 40 bits with the interrupts disabled
+	simAdvance(1100);
+	simAdvanceBlocked(4000);
+
+	lastResult = !simDhtFail;
+	if (lastResult) {
+		humidity = round(simHumidity * 10) / 10.0;
+		temperature = round(simTemperature * 10) / 10.0;
+	}
+	return lastResult;
+}
+
+float DHT::readHumidity(bool force) {
+	return read(force) ? humidity : NAN;
+}
+
+float DHT::readTemperature(bool fahrenheit, bool force) {
+	return read(force) ? (fahrenheit ? temperature * 1.8 + 32 : temperature) : NAN;
+}
+
+
+/* EEPROM: a write takes 3.4 millisecs */
+uint8_t simEeprom[1024];
+unsigned long simEepromWrites[1024];
+static unsigned long eepromReadyAt = 0;
+EEPROMClass EEPROM;
+
+static struct EepromErased {
+	EepromErased() { memset(simEeprom, 0xFF, sizeof(simEeprom)); }
+} eepromErased;
+
+bool eeprom_is_ready() {
+	return simMicros >= eepromReadyAt;
+}
+
+uint8_t EEPROMClass::read(int address) {
+	if (!eeprom_is_ready()) {
+		simAdvance(eepromReadyAt - simMicros);
+	}
+	return simEeprom[address & 1023];
+}
+
+void EEPROMClass::write(int address, uint8_t value) {
+	if (!eeprom_is_ready()) {
+		simAdvance(eepromReadyAt - simMicros);
+	}
+	simEeprom[address & 1023] = value;
+	simEepromWrites[address & 1023]++;
+	eepromReadyAt = simMicros + 3400;
+}
+
+void EEPROMClass::update(int address, uint8_t value) {
+	if (read(address) != value) {
+		write(address, value);
+	}
+}
+
+
+/* Serial */
+std::vector<uint8_t> simSerialOut;
+HardwareSerial Serial;
@@ -0,0 +1,217 @@
+/*
+ * The simulated atmega328: time, interrupts, pins, Timer0 with the ADC, SRAM.
+ */
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "sim_internal.h"
+
+unsigned long simMicros = 0;
+bool simInterruptsEnabled = true;
+static bool simInIsr = false;
+
+volatile uint8_t TWBR, ADMUX, ADCSRA, ADCSRB, UCSR0B, UCSR0C;
+volatile uint16_t ADC, UBRR0;
+
+// Timer0 overflows every 1024 micros (prescaler 64 at 16 MHz) and can trigger the ADC
+const unsigned long timer0Period = 1024;
+static unsigned long timer0Next = timer0Period;
+static bool adcFlag = false;
+unsigned int simAmbientAdc = 0;
+
+static bool adcAutoTriggered() {
+	return (ADCSRA & _BV(ADEN)) && (ADCSRA & _BV(ADATE)) && (ADCSRB & 7) == _BV(ADTS2);
+}
+
+void simCallIsr(void (*isr)(void)) {
+	simInterruptsEnabled = false;
+	simInIsr = true;
+	isr();
+	simInIsr = false;
+	simInterruptsEnabled = true;
+}
+
+// handle everything due by simMicros and serve the pending interrupts in the order of their vectors
+static void simServiceDue() {
+	for (int guard = 0; guard < 100000; guard++) {
+		bool again = false;
+
+		if (simMicros >= timer0Next) {
+			timer0Next += timer0Period;
+			if (adcAutoTriggered()) {
+				adcFlag = true;
+			}
+			again = true;
+		}
+		simUartService();
+		simTwiService();
+
+		if (simInterruptsEnabled && !simInIsr) {
+			if (simUartInterrupt()) {
+				again = true;
+			}
+			else if (adcFlag && (ADCSRA & _BV(ADIE)) && ADC_vect) {
+				adcFlag = false;
+				ADC = simAmbientAdc;
+				simCallIsr(ADC_vect);
+				again = true;
+			}
+			else if (simTwiInterrupt()) {
+				again = true;
+			}
+		}
+		if (!again) {
+			return;
+		}
+	}
+	fprintf(stderr, "sim: an interrupt keeps firing at %lu us (the handler does not clear it)\n", simMicros);
+	abort();
+}
+
+void simAdvance(unsigned long us) {
+	unsigned long end = simMicros + us;
+
+	simServiceDue();
+	for (;;) {
+		unsigned long next = min(timer0Next, min(simUartNextEvent(), simTwiNextEvent()));
+		if (next > end) {
+			break;
+		}
+		simMicros = max(simMicros, next);
+		simServiceDue();
+	}
+	simMicros = end;
+	simServiceDue();
+}
+
+void simAdvanceBlocked(unsigned long us) {
+	bool enabled = simInterruptsEnabled;
+	simInterruptsEnabled = false;
+	simAdvance(us);
+	simInterruptsEnabled = enabled;
+	simAdvance(0);
+}
+
+unsigned long millis() { return simMicros / 1000; }
+unsigned long micros() { return simMicros; }
+void delay(unsigned long ms) { simAdvance(ms * 1000); }
+void delayMicroseconds(unsigned int us) { simAdvance(us); }
+
+
+// pins: D0 - D13 and A0 - A7 (14 - 21)
+const int pinCount = 22;
+static uint8_t pinModes[pinCount];
+static uint8_t pinWritten[pinCount];
+static uint8_t pinDriven[pinCount];
+static int pinPwm[pinCount];
+std::vector<SimPinChange> simPinChanges;
+
+void pinMode(uint8_t pin, uint8_t mode) {
+	if (pin < pinCount) {
+		pinModes[pin] = mode;
+	}
+}
+
+void digitalWrite(uint8_t pin, uint8_t value) {
+	if (pin >= pinCount) {
+		return;
+	}
+	value = value ? HIGH : LOW;
+	if (pinModes[pin] == OUTPUT && pinWritten[pin] != value) {
+		simPinChanges.push_back({simMicros, pin, value});
+	}
+	pinWritten[pin] = value;
+}
+
+int digitalRead(uint8_t pin) {
+	if (pin >= pinCount) {
+		return LOW;
+	}
+	return pinModes[pin] == OUTPUT ? pinWritten[pin] : pinDriven[pin];
+}
+
+void analogWrite(uint8_t pin, int value) {
+	if (pin < pinCount) {
+		pinMode(pin, OUTPUT);
+		pinPwm[pin] = value;
+		digitalWrite(pin, value > 0);
+	}
+}
+
+int analogRead(uint8_t pin) {
+	return simAmbientAdc;
+}
+
+void simSetInput(uint8_t pin, uint8_t level) {
+	if (pin < pinCount) {
+		pinDriven[pin] = level;
+	}
+}
+
+uint8_t simOutput(uint8_t pin) {
+	return pin < pinCount ? pinWritten[pin] : LOW;
+}
+
+int simAnalogOutput(uint8_t pin) {
+	return pin < pinCount ? pinPwm[pin] : 0;
+}
+
+
+// SRAM: .data and .bss take the first 768 bytes, the heap follows, the stack starts at the top
+char simRam[2048];
+char* simDataStart = simRam;
+char* simBssEnd = simRam + 768;
+char* simHeapStart = simRam + 768;
+char* simBrkval = 0;
+struct __freelist* simFreeList = 0;
+uintptr_t simSP = (uintptr_t)(simRam + sizeof(simRam) - 1);
+
+
+bool simIsolated(void (*body)(void* result), void* result, size_t size) {
+	int fds[2];
+
+	fflush(stdout);
+	fflush(stderr);
+	if (pipe(fds) != 0) {
+		return false;
+	}
+
+	pid_t child = fork();
+	if (child < 0) {
+		return false;
+	}
+	if (child == 0) {
+		close(fds[0]);
+		body(result);
+		const char* p = (const char*)result;
+		size_t left = size;
+		while (left > 0) {
+			ssize_t n = write(fds[1], p, left);
+			if (n <= 0) {
+				_exit(1);
+			}
+			p += n;
+			left -= n;
+		}
+		fflush(stdout);
+		fflush(stderr);
+		_exit(0);
+	}
+
+	close(fds[1]);
+	char* p = (char*)result;
+	size_t got = 0;
+	while (got < size) {
+		ssize_t n = read(fds[0], p + got, size - got);
+		if (n <= 0) {
+			break;
+		}
+		got += n;
+	}
+	close(fds[0]);
+
+	int status = 0;
+	waitpid(child, &status, 0);
+	return got == size && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
@@ -0,0 +1,87 @@
+/*
+ * A simulated atmega328 for the host build of the sketch.
+ * Time only moves when the sketch waits (delay(), the LCD, the DHT) or a test lets it pass;
+ * the peripherals (Timer0 and the ADC, the UART, the TWI with an SHT3x on it, the EEPROM)
+ * act at their own pace in between and call the sketch's interrupt handlers.
+ * Note: int is 32 bits and long is 64 bits on the host, so 16-bit overflows do not show here.
+ */
+#ifndef HOST_SIM_H
+#define HOST_SIM_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include <vector>
+
+// a register with side effects on read or write (TWCR, UDR0 and friends)
+class SimRegister {
+public:
+	constexpr SimRegister(uint8_t (*reader)(), void (*writer)(uint8_t)) : reader(reader), writer(writer), value(0) {}
+	operator uint8_t() const { return reader ? reader() : value; }
+	SimRegister& operator=(uint8_t v) { if (writer) writer(v); else value = v; return *this; }
+	SimRegister& operator|=(uint8_t v) { return *this = (uint8_t)(*this) | v; }
+	SimRegister& operator&=(uint8_t v) { return *this = (uint8_t)(*this) & v; }
+private:
+	uint8_t (*reader)();
+	void (*writer)(uint8_t);
+public:
+	uint8_t value;
+};
+
+// time
+extern unsigned long simMicros;
+extern bool simInterruptsEnabled;
+void simAdvance(unsigned long us);          // let time pass; the interrupts are served
+void simAdvanceBlocked(unsigned long us);   // let time pass with the interrupts disabled
+
+// pins
+void simSetInput(uint8_t pin, uint8_t level);   // what the outside world drives onto an input
+uint8_t simOutput(uint8_t pin);                 // the level the sketch writes
+int simAnalogOutput(uint8_t pin);               // the PWM value the sketch writes
+struct SimPinChange { unsigned long time; uint8_t pin; uint8_t level; };
+extern std::vector<SimPinChange> simPinChanges; // every change of an output, in order
+
+// humidity sensors and the light sensor
+extern float simHumidity;                   // %
+extern float simTemperature;                // Celsius
+extern bool simDhtFail;                     // the DHT does not answer
+extern unsigned long simDhtReads;           // DHT transactions
+extern void (*simSensorHook)();             // called when a sensor starts a measurement
+extern bool simShtPresent;                  // the SHT3x answers its address
+extern bool simShtBadCrc;                   // the SHT3x sends a broken CRC
+extern unsigned long simShtConversionTime;  // micros of a single shot measurement
+extern unsigned long simShtMeasurements;    // measure commands received
+extern unsigned long simTwiBytes;           // bytes moved on the I2C bus
+extern unsigned int simAmbientAdc;          // what the ADC converts (0 - 1023)
+
+// UART (the registers) and Serial (the Arduino object)
+void simUartReceive(const uint8_t* data, size_t length);   // bytes arriving on RX back to back from now
+unsigned long simUartByteTime();            // micros per byte at the baud rate set
+struct SimUartByte { uint8_t value; unsigned long end; };
+extern std::vector<SimUartByte> simUartSent;    // bytes sent on TX with the time their stop bit ended
+extern unsigned long simUartOverruns;       // bytes lost because the receiver was not read in time
+extern std::vector<uint8_t> simSerialOut;   // bytes written to Serial
+
+// LCD (HD44780)
+std::string simLcdRow(uint8_t row);         // the 16 characters shown in the row
+extern unsigned long simLcdBusWrites;       // commands and data bytes sent to the display
+extern uint8_t simLcdCgram[64];             // the custom characters
+
+// EEPROM
+extern uint8_t simEeprom[1024];
+extern unsigned long simEepromWrites[1024]; // erase/write cycles of each cell
+
+// SRAM: the sketch's __heap_start, __brkval, SP ... point in here
+extern char simRam[2048];
+extern char* simDataStart;
+extern char* simBssEnd;
+extern char* simHeapStart;
+extern char* simBrkval;
+extern struct __freelist* simFreeList;
+extern uintptr_t simSP;
+
+// run body in a child process with the sketch as it is now (usually before setup()),
+// so a test can boot the sketch more than once; result is copied back. Returns false if the child failed.
+bool simIsolated(void (*body)(void* result), void* result, size_t size);
+
+#endif
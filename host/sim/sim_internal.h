@@ -0,0 +1,32 @@
+/*
+ * Shared between the parts of the simulated atmega328.
+ */
+#ifndef HOST_SIM_INTERNAL_H
+#define HOST_SIM_INTERNAL_H
+
+#include <Arduino.h>
+
+// the sketch's interrupt handlers; a build without one leaves it null
+extern "C" {
+void ADC_vect(void) __attribute__((weak));
+void TWI_vect(void) __attribute__((weak));
+void USART_RX_vect(void) __attribute__((weak));
+void USART_UDRE_vect(void) __attribute__((weak));
+void USART_TX_vect(void) __attribute__((weak));
+}
+
+const unsigned long simNever = ~0UL;
+
+// run an interrupt handler the way the CPU does (the interrupts are disabled inside)
+void simCallIsr(void (*isr)(void));
+
+// each peripheral: the time of its next event, the events due by simMicros,
+// and one pending interrupt served (true if there was one)
+unsigned long simUartNextEvent();
+void simUartService();
+bool simUartInterrupt();
+unsigned long simTwiNextEvent();
+void simTwiService();
+bool simTwiInterrupt();
+
+#endif
@@ -0,0 +1,181 @@
+/*
+ * The simulated TWI (I2C) master at 100 kHz with an SHT3x at address 0x44 on the bus.
+ * The SHT3x answers the single shot command 0x2400; reading it before the conversion is done gets a NACK.
+ */
+#include "sim_internal.h"
+
+enum TwiPhase { twiPhaseIdle, twiPhaseStarted, twiPhaseWriting, twiPhaseReading, twiPhaseNacked };
+
+static TwiPhase phase = twiPhaseIdle;
+static uint8_t control = 0;         // TWEA, TWSTA, TWSTO, TWEN, TWIE as written
+static bool flag = false;           // TWINT
+static uint8_t status = 0xF8;       // TWSR status bits
+static uint8_t prescaler = 0;
+static bool operating = false;      // START or a byte on the bus
+static bool operationStart;
+static unsigned long operationEnd;
+
+static uint8_t command[2];          // SHT3x command received
+static uint8_t commandLength;
+static bool converting = false;
+static unsigned long conversionStart;
+static uint8_t result[6];
+static uint8_t resultIndex;
+
+bool simShtPresent = true;
+bool simShtBadCrc = false;
+unsigned long simShtConversionTime = 12500;   // high repeatability: 12.5 ms typical (15.5 ms max)
+unsigned long simShtMeasurements = 0;
+unsigned long simTwiBytes = 0;
+
+static uint8_t shtCrc(uint8_t a, uint8_t b) {
+	uint8_t data[2] = {a, b};
+	uint8_t crc = 0xFF;
+
+	for (int i = 0; i < 2; i++) {
+		crc ^= data[i];
+		for (int bit = 0; bit < 8; bit++) {
+			crc = (crc & 0x80) ? (crc << 1) ^ 0x31 : crc << 1;
+		}
+	}
+	return crc;
+}
+
+static void shtPrepareResult() {
+	double t = (simTemperature + 45) / 175 * 65535;
+	double h = simHumidity / 100 * 65535;
+	uint16_t rawT = constrain(t + 0.5, 0, 65535);
+	uint16_t rawH = constrain(h + 0.5, 0, 65535);
+
+	result[0] = rawT >> 8;
+	result[1] = rawT & 0xFF;
+	result[2] = shtCrc(result[0], result[1]);
+	result[3] = rawH >> 8;
+	result[4] = rawH & 0xFF;
+	result[5] = shtCrc(result[3], result[4]) ^ (simShtBadCrc ? 1 : 0);
+	resultIndex = 0;
+}
+
+// the master has finished writing to the sensor
+static void shtCommandDone() {
+	if (commandLength == 2 && command[0] == 0x24 && command[1] == 0x00) {
+		if (simSensorHook) {
+			simSensorHook();
+		}
+		converting = true;
+		conversionStart = simMicros;
+		simShtMeasurements++;
+	}
+}
+
+static uint8_t controlRead() {
+	return control | (flag << TWINT);
+}
+
+static void controlWrite(uint8_t value) {
+	control = value & (_BV(TWEA) | _BV(TWSTA) | _BV(TWSTO) | _BV(TWEN) | _BV(TWIE));
+
+	if (!(value & _BV(TWEN))) {
+		phase = twiPhaseIdle;
+		operating = false;
+		return;
+	}
+	if (!(value & _BV(TWINT))) {
+		return;
+	}
+
+	flag = false;
+	if (value & _BV(TWSTO)) {
+		if (phase == twiPhaseWriting) {
+			shtCommandDone();
+		}
+		phase = twiPhaseIdle;
+		control &= ~_BV(TWSTO);
+		if (!(value & _BV(TWSTA))) {
+			return;
+		}
+	}
+	operating = true;
+	operationStart = value & _BV(TWSTA);
+	operationEnd = simMicros + (operationStart ? 10 : 90);   // 9 clocks per byte
+}
+
+static uint8_t statusRegisterRead() {
+	return status | prescaler;
+}
+
+static void statusRegisterWrite(uint8_t value) {
+	prescaler = value & 3;
+}
+
+SimRegister TWCR(controlRead, controlWrite);
+SimRegister TWSR(statusRegisterRead, statusRegisterWrite);
+SimRegister TWDR(0, 0);
+
+unsigned long simTwiNextEvent() {
+	return operating ? operationEnd : simNever;
+}
+
+void simTwiService() {
+	if (!operating || operationEnd > simMicros) {
+		return;
+	}
+	operating = false;
+	flag = true;
+
+	if (operationStart) {
+		if (phase == twiPhaseWriting) {
+			shtCommandDone();
+		}
+		status = (phase == twiPhaseIdle) ? 0x08 : 0x10;
+		phase = twiPhaseStarted;
+		return;
+	}
+
+	simTwiBytes++;
+	switch (phase) {
+		case twiPhaseStarted: {
+			uint8_t address = TWDR.value;
+			bool present = simShtPresent && (address >> 1) == 0x44;
+
+			if (!(address & 1)) {
+				status = present ? 0x18 : 0x20;
+				phase = present ? twiPhaseWriting : twiPhaseNacked;
+				commandLength = 0;
+			}
+			else if (present && converting && simMicros - conversionStart >= simShtConversionTime) {
+				converting = false;
+				shtPrepareResult();
+				status = 0x40;
+				phase = twiPhaseReading;
+			}
+			else {
+				status = 0x48;
+				phase = twiPhaseNacked;
+			}
+			break;
+		}
+		case twiPhaseWriting:
+			if (commandLength < 2) {
+				command[commandLength] = TWDR.value;
+			}
+			commandLength++;
+			status = 0x28;
+			break;
+		case twiPhaseReading:
+			TWDR.value = result[resultIndex++ % 6];
+			status = (control & _BV(TWEA)) ? 0x50 : 0x58;
+			break;
+		default:
+			status = 0xF8;
+			break;
+	}
+}
+
+bool simTwiInterrupt() {
+	if (flag && (control & _BV(TWIE)) && TWI_vect) {
+		simCallIsr(TWI_vect);
+		return true;
+	}
+	return false;
+}
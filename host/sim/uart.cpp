@@ -0,0 +1,136 @@
+/*
+ * The simulated USART0: a 2 byte receive FIFO, the transmit buffer and shift register,
+ * the RX complete, data register empty and TX complete interrupts.
+ */
+#include <deque>
+#include <utility>
+
+#include "sim_internal.h"
+
+static std::deque<std::pair<unsigned long, uint8_t> > rxLine;  // bytes on the way: (stop bit end, value)
+static unsigned long rxLineEnd = 0;     // when the last byte on the way arrives
+static std::deque<uint8_t> rxFifo;      // received and not read yet (the hardware holds 2)
+static bool rxOverrun = false;
+static bool txShifting = false;         // a byte is leaving
+static unsigned long txShiftEnd;        // and ends then
+static uint8_t txShiftValue;
+static bool txBufferFull = false;       // UDR0 holds the next byte
+static uint8_t txBuffer;
+static bool txComplete = false;         // TXC0
+static bool doubleSpeed = false;        // U2X0
+
+std::vector<SimUartByte> simUartSent;
+unsigned long simUartOverruns = 0;
+
+unsigned long simUartByteTime() {
+	unsigned long divider = doubleSpeed ? 8 : 16;
+	unsigned long baud = F_CPU / (divider * (UBRR0 + 1UL));
+	return (10000000UL + baud / 2) / baud;    // start bit, 8 data bits, stop bit
+}
+
+static uint8_t statusRead() {
+	return (!rxFifo.empty() << RXC0) | (txComplete << TXC0) | (!txBufferFull << UDRE0) | (rxOverrun << DOR0) | (doubleSpeed << U2X0);
+}
+
+static void statusWrite(uint8_t value) {
+	if (value & _BV(TXC0)) {
+		txComplete = false;    // cleared by writing a one
+	}
+	doubleSpeed = value & _BV(U2X0);
+}
+
+static uint8_t dataRead() {
+	if (rxFifo.empty()) {
+		return 0;
+	}
+	uint8_t value = rxFifo.front();
+	rxFifo.pop_front();
+	rxOverrun = false;
+	return value;
+}
+
+static void dataWrite(uint8_t value) {
+	if (!(UCSR0B & _BV(TXEN0))) {
+		return;
+	}
+	if (!txShifting) {
+		txShifting = true;
+		txShiftValue = value;
+		txShiftEnd = simMicros + simUartByteTime();
+	}
+	else {
+		txBufferFull = true;
+		txBuffer = value;
+	}
+}
+
+SimRegister UCSR0A(statusRead, statusWrite);
+SimRegister UDR0(dataRead, dataWrite);
+
+void simUartReceive(const uint8_t* data, size_t length) {
+	unsigned long time = max(simMicros, rxLineEnd);
+
+	for (size_t i = 0; i < length; i++) {
+		time += simUartByteTime();
+		rxLine.push_back(std::make_pair(time, data[i]));
+	}
+	rxLineEnd = time;
+}
+
+unsigned long simUartNextEvent() {
+	unsigned long next = simNever;
+
+	if (!rxLine.empty()) {
+		next = rxLine.front().first;
+	}
+	if (txShifting) {
+		next = min(next, txShiftEnd);
+	}
+	return next;
+}
+
+void simUartService() {
+	while (!rxLine.empty() && rxLine.front().first <= simMicros) {
+		if (!(UCSR0B & _BV(RXEN0))) {
+			// the receiver is off; the byte passes by
+		}
+		else if (rxFifo.size() < 2) {
+			rxFifo.push_back(rxLine.front().second);
+		}
+		else {
+			rxOverrun = true;
+			simUartOverruns++;
+		}
+		rxLine.pop_front();
+	}
+
+	while (txShifting && txShiftEnd <= simMicros) {
+		simUartSent.push_back({txShiftValue, txShiftEnd});
+		if (txBufferFull) {
+			txShiftValue = txBuffer;
+			txBufferFull = false;
+			txShiftEnd += simUartByteTime();
+		}
+		else {
+			txShifting = false;
+			txComplete = true;
+		}
+	}
+}
+
+bool simUartInterrupt() {
+	if ((UCSR0B & _BV(RXCIE0)) && !rxFifo.empty() && USART_RX_vect) {
+		simCallIsr(USART_RX_vect);
+		return true;
+	}
+	if ((UCSR0B & _BV(UDRIE0)) && !txBufferFull && USART_UDRE_vect) {
+		simCallIsr(USART_UDRE_vect);
+		return true;
+	}
+	if ((UCSR0B & _BV(TXCIE0)) && txComplete && USART_TX_vect) {
+		txComplete = false;    // cleared by running the handler
+		simCallIsr(USART_TX_vect);
+		return true;
+	}
+	return false;
+}
@@ -0,0 +1,12 @@
+/*
+ * The sketch compiled for the host: the Arduino API, the prototypes and lcdDht.h.
+ * A test includes this once and drives setup() and loop() itself.
+ */
+#ifndef HOST_SKETCH_H
+#define HOST_SKETCH_H
+
+#include <Arduino.h>
+#include "sketch_prototypes.h"
+#include "../lcdDht.h"
+
+#endif
@@ -0,0 +1,115 @@
+/*
+ * Arduino API for the host build of the sketch.
+ * Only what lcdDht.h uses; the behaviour follows the AVR core. The simulated atmega328
+ * behind it (time, pins, UART, TWI, ADC, EEPROM, the LCD) lives in host/sim.
+ */
+#ifndef HOST_ARDUINO_H
+#define HOST_ARDUINO_H
+
+// the standard headers go first: the macros below (min, max, round) break them
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <string>
+
+#include "sim.h"
+
+typedef uint8_t byte;
+typedef bool boolean;
+typedef unsigned int word;
+
+#define HIGH 1
+#define LOW 0
+#define INPUT 0
+#define OUTPUT 1
+#define INPUT_PULLUP 2
+
+#define DEC 10
+#define HEX 16
+
+#define F_CPU 16000000UL
+
+#define min(a,b) ((a)<(b)?(a):(b))
+#define max(a,b) ((a)>(b)?(a):(b))
+#define constrain(amt,low,high) ((amt)<(low)?(low):((amt)>(high)?(high):(amt)))
+#define round(x) ((x)>=0?(long)((x)+0.5):(long)((x)-0.5))
+
+#define lowByte(w) ((uint8_t) ((w) & 0xff))
+#define highByte(w) ((uint8_t) ((w) >> 8))
+#define bit(b) (1UL << (b))
+#define _BV(b) (1 << (b))
+
+inline unsigned int makeWord(uint8_t h, uint8_t l) { return (h << 8) | l; }
+#define word(...) makeWord(__VA_ARGS__)
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t value);
+int digitalRead(uint8_t pin);
+void analogWrite(uint8_t pin, int value);
+int analogRead(uint8_t pin);
+
+// avr/interrupt.h
+#define ISR(vector) extern "C" void vector(void)
+inline void cli() { simInterruptsEnabled = false; }
+inline void sei() { simInterruptsEnabled = true; }
+#define noInterrupts() cli()
+#define interrupts() sei()
+
+// avr/io.h: the registers the sketch touches
+#define TWINT 7
+#define TWEA 6
+#define TWSTA 5
+#define TWSTO 4
+#define TWEN 2
+#define TWIE 0
+#define ADEN 7
+#define ADSC 6
+#define ADATE 5
+#define ADIF 4
+#define ADIE 3
+#define ADPS2 2
+#define ADPS1 1
+#define ADPS0 0
+#define REFS0 6
+#define ADTS2 2
+#define ADTS1 1
+#define ADTS0 0
+#define RXC0 7
+#define TXC0 6
+#define UDRE0 5
+#define DOR0 3
+#define U2X0 1
+#define MPCM0 0
+#define RXCIE0 7
+#define TXCIE0 6
+#define UDRIE0 5
+#define RXEN0 4
+#define TXEN0 3
+#define UCSZ01 2
+#define UCSZ00 1
+
+extern SimRegister TWCR, TWSR, TWDR, UCSR0A, UDR0;
+extern volatile uint8_t TWBR, ADMUX, ADCSRA, ADCSRB, UCSR0B, UCSR0C;
+extern volatile uint16_t ADC, UBRR0;
+
+// the sketch's memory symbols point into the simulated SRAM
+#define SP simSP
+#define __data_start (*simDataStart)
+#define __bss_end (*simBssEnd)
+#define __heap_start (*simHeapStart)
+#define __brkval simBrkval
+#define __flp simFreeList
+
+#include "WString.h"
+#include "Print.h"
+#include "HardwareSerial.h"
+
+#endif
@@ -0,0 +1,31 @@
+/*
+ * Adafruit DHT library reading simHumidity and simTemperature.
+ * Like the library, it talks to the sensor at most every 2 seconds and returns the cached
+ * values in between; a transaction holds the interrupts disabled for about 4 millisecs.
+ */
+#ifndef HOST_DHT_H
+#define HOST_DHT_H
+
+#include <Arduino.h>
+
+#define DHT11 11
+#define DHT22 22
+#define DHT21 21
+#define AM2301 21
+
+class DHT {
+public:
+	DHT(uint8_t pin, uint8_t type, uint8_t count = 6) {}
+	void begin();
+	float readHumidity(bool force = false);
+	float readTemperature(bool fahrenheit = false, bool force = false);
+
+private:
+	bool read(bool force);
+	unsigned long lastRead = 0;
+	bool lastResult = false;
+	float humidity = NAN;
+	float temperature = NAN;
+};
+
+#endif
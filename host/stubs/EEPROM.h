@@ -0,0 +1,21 @@
+/*
+ * Arduino EEPROM on the simulated 1 KB EEPROM. A write takes 3.4 millisecs;
+ * writing while the previous write is running waits for it like avr-libc does.
+ */
+#ifndef HOST_EEPROM_H
+#define HOST_EEPROM_H
+
+#include <Arduino.h>
+
+bool eeprom_is_ready();
+
+struct EEPROMClass {
+	uint8_t read(int address);
+	void write(int address, uint8_t value);
+	void update(int address, uint8_t value);
+	uint16_t length() { return 1024; }
+};
+
+extern EEPROMClass EEPROM;
+
+#endif
@@ -0,0 +1,26 @@
+/*
+ * Arduino Serial. What the sketch writes is collected in simSerialOut; nothing is received.
+ */
+#ifndef HOST_HARDWARESERIAL_H
+#define HOST_HARDWARESERIAL_H
+
+#define SERIAL_TX_BUFFER_SIZE 64
+
+class HardwareSerial : public Print {
+public:
+	void begin(unsigned long baud) { this->baud = baud; }
+	void end() {}
+	int available() { return 0; }
+	int read() { return -1; }
+	int availableForWrite() { return SERIAL_TX_BUFFER_SIZE - 1; }
+	void flush() {}
+	size_t write(uint8_t b) { simSerialOut.push_back(b); return 1; }
+	using Print::write;
+	operator bool() { return true; }
+
+	unsigned long baud = 0;
+};
+
+extern HardwareSerial Serial;
+
+#endif
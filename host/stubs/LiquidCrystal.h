@@ -0,0 +1,26 @@
+/*
+ * LiquidCrystal in 4-bit mode driving the simulated HD44780.
+ * Every command and data byte takes the time the library spends on it.
+ */
+#ifndef HOST_LIQUIDCRYSTAL_H
+#define HOST_LIQUIDCRYSTAL_H
+
+#include <Arduino.h>
+
+class LiquidCrystal : public Print {
+public:
+	LiquidCrystal(uint8_t rs, uint8_t enable, uint8_t d0, uint8_t d1, uint8_t d2, uint8_t d3) {}
+
+	void begin(uint8_t cols, uint8_t rows);
+	void clear();
+	void home();
+	void setCursor(uint8_t col, uint8_t row);
+	void createChar(uint8_t location, uint8_t charmap[]);
+	void display() { command(0x0C); }
+	void noDisplay() { command(0x08); }
+	void command(uint8_t value);
+	size_t write(uint8_t value);
+	using Print::write;
+};
+
+#endif
@@ -0,0 +1,35 @@
+/*
+ * Arduino Print: everything ends in write(byte).
+ */
+#ifndef HOST_PRINT_H
+#define HOST_PRINT_H
+
+class Print {
+public:
+	virtual ~Print() {}
+	virtual size_t write(uint8_t b) = 0;
+	virtual size_t write(const uint8_t* buffer, size_t size) {
+		size_t n = 0;
+		while (size--) {
+			n += write(*buffer++);
+		}
+		return n;
+	}
+	size_t write(const char* s) { return write((const uint8_t*)s, strlen(s)); }
+	size_t write(const char* buffer, size_t size) { return write((const uint8_t*)buffer, size); }
+
+	size_t print(const char* s) { return write(s); }
+	size_t print(const String& s) { return write(s.c_str(), s.length()); }
+	size_t print(char c) { return write((uint8_t)c); }
+	size_t print(unsigned char v, int base = DEC) { return print(String(v, base)); }
+	size_t print(int v, int base = DEC) { return print(String(v, base)); }
+	size_t print(unsigned int v, int base = DEC) { return print(String(v, base)); }
+	size_t print(long v, int base = DEC) { return print(String(v, base)); }
+	size_t print(unsigned long v, int base = DEC) { return print(String(v, base)); }
+	size_t print(double v, int decimals = 2) { return print(String(v, decimals)); }
+
+	size_t println() { return write("\r\n"); }
+	template <class T> size_t println(T v) { return print(v) + println(); }
+};
+
+#endif
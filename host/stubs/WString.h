@@ -0,0 +1,57 @@
+/*
+ * Arduino String on top of std::string: numbers print in decimal, floats with 2 decimals.
+ */
+#ifndef HOST_WSTRING_H
+#define HOST_WSTRING_H
+
+class String {
+public:
+	String(const char* s = "") : s(s) {}
+	String(const std::string& s) : s(s) {}
+	explicit String(char c) : s(1, c) {}
+	explicit String(unsigned char v, unsigned char base = 10) : s(number(v, base)) {}
+	explicit String(int v, unsigned char base = 10) : s(v < 0 && base == 10 ? "-" + number(-(long)v, base) : number((unsigned int)v, base)) {}
+	explicit String(unsigned int v, unsigned char base = 10) : s(number(v, base)) {}
+	explicit String(long v, unsigned char base = 10) : s(v < 0 && base == 10 ? "-" + number(-v, base) : number((unsigned long)v, base)) {}
+	explicit String(unsigned long v, unsigned char base = 10) : s(number(v, base)) {}
+	explicit String(float v, unsigned char decimals = 2) : s(decimal(v, decimals)) {}
+	explicit String(double v, unsigned char decimals = 2) : s(decimal(v, decimals)) {}
+
+	unsigned int length() const { return s.length(); }
+	char operator[](unsigned int i) const { return i < s.length() ? s[i] : 0; }
+	const char* c_str() const { return s.c_str(); }
+	bool operator==(const String& other) const { return s == other.s; }
+
+	String& operator+=(const String& other) { s += other.s; return *this; }
+	String& operator+=(const char* other) { s += other; return *this; }
+	String& operator+=(char c) { s += c; return *this; }
+
+	static std::string number(unsigned long v, unsigned char base) {
+		std::string out;
+		do {
+			out.insert(out.begin(), "0123456789ABCDEF"[v % base]);
+			v /= base;
+		} while (v);
+		return out;
+	}
+	static std::string decimal(double v, unsigned char decimals) {
+		char buffer[48];
+		snprintf(buffer, sizeof(buffer), "%.*f", decimals, v);
+		return buffer;
+	}
+
+private:
+	std::string s;
+};
+
+inline String operator+(const String& a, const String& b) { String r(a); r += b; return r; }
+inline String operator+(const String& a, const char* b) { String r(a); r += b; return r; }
+inline String operator+(const char* a, const String& b) { String r(a); r += b; return r; }
+inline String operator+(const String& a, char b) { String r(a); r += b; return r; }
+inline String operator+(const String& a, unsigned char b) { return a + String(b); }
+inline String operator+(const String& a, int b) { return a + String(b); }
+inline String operator+(const String& a, unsigned int b) { return a + String(b); }
+inline String operator+(const String& a, long b) { return a + String(b); }
+inline String operator+(const String& a, unsigned long b) { return a + String(b); }
+
+#endif
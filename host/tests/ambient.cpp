@@ -0,0 +1,80 @@
+/*
+ * The ambient light sensor at a "Dark level" near the top of the scale: dark below it, bright again
+ * at the full light (the hysteresis is cut at 255), and the trace records of the ambient light
+ * turning dark or bright and of a setting written over Modbus.
+ */
+#include "harness.h"
+
+// the light measured for a while
+void lightAt(byte level) {
+	simAmbientAdc = level << 2;
+	hostRunFor(200);
+}
+
+bool darkAt(byte level) {
+	lightAt(level);
+	return ambientIsDark();
+}
+
+struct Traced {
+	bool answer;
+	byte event, arg;
+	unsigned long payload[3];   // as recorded (the ambient level is zigzag encoded, the setting values are not)
+};
+
+// call ask() and decode the record it adds to the trace
+Traced newest(bool (*ask)()) {
+	Traced t;
+	byte from = traceHead;
+	byte pos = from + 1;
+
+	t.answer = ask();
+	CHECK(traceHead != from);
+	t.event = traceBuffer[from] & 0x0F;
+	t.arg = traceBuffer[from] >> 4;
+	traceReadVarint(pos);
+	for (byte i = 0; i < 3; i++) {
+		t.payload[i] = (pos != traceHead) ? traceReadVarint(pos) : 0;
+	}
+	CHECK(pos == traceHead);
+	return t;
+}
+
+int main() {
+	for (byte i = 0; i < settingsCount; i++) {
+		simEeprom[i] = defaultSettings[i];
+	}
+	simEeprom[9] = 250;
+	simEeprom[settingsCountAddress] = settingsCount;
+	simHumidity = 40;
+	setup();
+	hostRunUntil(3000);
+
+	// dark below 250, still dark just above it, bright at the full light
+	CHECK(darkAt(100));
+	CHECK(darkAt(252));
+	lightAt(255);
+	Traced t = newest(ambientIsDark);
+	CHECK(!t.answer);
+	CHECK(t.event == traceEventAmbient && t.arg == 0 && traceUnzigzag(t.payload[0]) == 255);
+	CHECK(!darkAt(252));
+	lightAt(249);
+	t = newest(ambientIsDark);
+	CHECK(t.answer);
+	CHECK(t.event == traceEventAmbient && t.arg == 1 && traceUnzigzag(t.payload[0]) == 249);
+
+	// the hysteresis as it was below the top of the scale
+	CHECK(modbusWriteSetting(9, 100) == 0);
+	CHECK(darkAt(50));
+	CHECK(darkAt(107));
+	CHECK(!darkAt(108));
+
+	// a Modbus write is traced with the address, the value and the value it replaced
+	t = newest([]() { return modbusWriteSetting(2, 55) == 0; });
+	CHECK(t.answer);
+	CHECK(t.event == traceEventSetting && t.arg == 1);
+	CHECK(t.payload[0] == 2 && t.payload[1] == 55 && t.payload[2] == defaultSettings[2]);
+
+	printf("ambient: checked\n");
+	return hostResult();
+}
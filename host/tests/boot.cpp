@@ -0,0 +1,41 @@
+/*
+ * Boot a build variant with an empty EEPROM and run it for a minute:
+ * the sensor is read, the fan follows the humidity and the settings are written to the EEPROM.
+ */
+#include "harness.h"
+
+int main() {
+	simHumidity = 60;
+	simTemperature = 22.5;
+
+	setup();
+	hostRunUntil(10000);
+
+	CHECK(firstDecisionTime > 0);
+	CHECK(!sensorFailed);
+	CHECK(lastHumidity == 600);
+	CHECK(lastTemperature == 225);
+	CHECK(hostFanOn());                         // 60 % is above the default 37 % limit
+
+	// the display shows what the dashboard drew; the pages rotate back to the readings
+	CHECK(simLcdRow(0) == std::string(lcdShadow[0], 16));
+	CHECK(simLcdRow(1) == std::string(lcdShadow[1], 16));
+	while (dashboardPage != 0 && millis() < 40000) {
+		loop();
+	}
+	CHECK(simLcdRow(0) == "22.50\xDF" "C   H: 60%");
+	CHECK(simLcdRow(1) == "Fan is ON       ");
+
+	// the default settings reached the EEPROM in the background
+	for (byte i = 0; i < sizeof(defaultSettings); i++) {
+		CHECK(simEeprom[i] == defaultSettings[i]);
+	}
+
+	// dry air: the fan stops once the lock time is over
+	simHumidity = 30;
+	hostRunUntil(minutesToMillis(eepromSettings[4]) + 20000);
+	CHECK(!hostFanOn());
+
+	printf("boot: first decision after %lu ms, %lu LCD bus writes\n", firstDecisionTime, simLcdBusWrites);
+	return hostResult();
+}
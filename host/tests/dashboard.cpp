@@ -0,0 +1,69 @@
+/*
+ * The dashboard on the simulated HD44780: LCD bus writes per page update (only the changed cells
+ * and CGRAM rows go to the display), the sparkline legend showing the real lowest and highest humidity
+ * and "Saving settings..." staying for a page time when the menu closes.
+ */
+#include "harness.h"
+
+// run to the start of page, return the bus writes of that page change
+unsigned long toPage(byte page) {
+	unsigned long writes = simLcdBusWrites;
+
+	while (dashboardPage != page) {
+		writes = simLcdBusWrites;
+		loop();
+	}
+	return simLcdBusWrites - writes;
+}
+
+int main() {
+	simHumidity = 50;
+	simTemperature = 21;
+	setup();
+	hostRunUntil(10 * 60000UL);
+
+	// a flat history is scaled over 8 % but the legend says what it is
+	toPage(1);
+	CHECK(simLcdRow(1) == "min 50% max 50% ");
+
+	// a page change writes what differs; the refreshes of an unchanged page write nothing
+	unsigned long pageWrites[dashboardPages];
+	unsigned long refreshWrites = 0;
+	for (byte i = 0; i < dashboardPages; i++) {
+		byte page = (1 + 1 + i) % dashboardPages;
+		pageWrites[page] = toPage(page);
+		unsigned long writes = simLcdBusWrites;
+		hostRunFor(dashboardPageTime - 100);
+		refreshWrites += simLcdBusWrites - writes;
+	}
+	unsigned long total = 0;
+	for (byte page = 0; page < dashboardPages; page++) {
+		CHECK(pageWrites[page] <= 2 * (16 + 1) + 8 * (8 + 1));     // never more than the whole display and CGRAM
+		total += pageWrites[page];
+	}
+	// memory page: the free RAM may change; the others are steady
+	CHECK(refreshWrites <= 2 * dashboardPages * (dashboardPageTime / dashboardRefresh));
+	// the sparkline glyphs stay in the CGRAM while the other pages are shown
+	CHECK(pageWrites[1] <= 2 * (16 + 1));
+
+	// the humidity goes up by 4 %: still scaled over 8 %, the legend shows 54
+	simHumidity = 54;
+	hostRunFor(2 * sparkSampleTime);
+	toPage(1);
+	CHECK(simLcdRow(1) == "min 50% max 54% ");
+
+	// leave the menu: the message stays until the next page, then the dashboard comes back
+	for (byte i = 0; i <= settingsCount; i++) {
+		hostPress(buttonSettings, 300);
+	}
+	CHECK(!modeSettings);
+	CHECK(simLcdRow(0).compare(0, 6, "Saving") == 0);
+	hostRunFor(dashboardPageTime - 1000);
+	CHECK(simLcdRow(1).compare(0, 11, "settings...") == 0);
+	hostRunFor(1000);
+	CHECK(simLcdRow(0).compare(0, 6, "Saving") != 0);
+
+	printf("dashboard: %lu bus writes for a round of %d page changes (%lu on the sparkline page), %lu for the refreshes\n",
+		total, dashboardPages, pageWrites[1], refreshWrites);
+	return hostResult();
+}
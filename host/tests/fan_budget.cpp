@@ -0,0 +1,96 @@
+/*
+ * The fan run budget against a reference token bucket, with the refill rate at 30 % (FAN_REFILL_RATE):
+ * fanBudget() is called every loop, so a refill rounded down in every call would never refill at all.
+ * The model keeps the budget exactly (in hundredths of millisecs) from the relay changes;
+ * when the fan starts after its rest, the budget is full again.
+ */
+#include "harness.h"
+
+struct Bucket {
+	long capacity;              // millisecs
+	long long budget;           // hundredths of millisecs
+
+	void run(unsigned long ms) {
+		budget = max(budget - (long long)ms * 100, 0LL);
+	}
+	void rest(unsigned long ms) {
+		budget = min(budget + (long long)ms * fanRefillRate, (long long)capacity * 100);
+	}
+	// the fan has rested for the whole rest time: the budget is full again
+	void fill() {
+		budget = (long long)capacity * 100;
+	}
+	long millisecs() {
+		return budget / 100;
+	}
+};
+
+// the bucket along the relay changes since index from, up to now; resting -> the protection was ON before them
+void follow(Bucket &model, size_t &from, unsigned long &time, bool &running, bool resting) {
+	for (; from < simPinChanges.size(); from++) {
+		const SimPinChange &c = simPinChanges[from];
+		if (c.pin != relayFan) {
+			continue;
+		}
+		unsigned long at = c.time / 1000;
+		running ? model.run(at - time) : model.rest(at - time);
+		time = at;
+		running = c.level == LOW;
+		if (running && resting) {
+			model.fill();
+		}
+	}
+	running ? model.run(millis() - time) : model.rest(millis() - time);
+	time = millis();
+}
+
+int main() {
+	CHECK(fanRefillRate == 30);
+
+	simHumidity = 80;
+	setup();
+
+	Bucket model = {(long)minutesToMillis(eepromSettings[5]), (long long)minutesToMillis(eepromSettings[5]) * 100};
+	size_t from = simPinChanges.size();
+	unsigned long time = millis();
+	bool running = false;
+	bool resting = false;
+	long worst = 0;
+
+	// the fan runs its budget out and rests; it runs again after the rest while the light is still ON
+	// after the power-up, then it rests while the light is OFF and the budget refills at 30 %
+	for (int second = 0; second < 600; second++) {
+		hostRunFor(1000);
+		follow(model, from, time, running, resting);
+		resting = fanProtect;
+		worst = max(worst, labs(fanBudget() - model.millisecs()));
+	}
+	CHECK(fanProtect);
+	CHECK(!hostFanOn());
+	// since the relay went OFF, the rest refilled 30 % of the time
+	unsigned long stopped = 0;
+	for (const SimPinChange &c : simPinChanges) {
+		if (c.pin == relayFan) {
+			stopped = c.time / 1000;
+		}
+	}
+	long rested = fanBudget();
+	CHECK(labs(rested - (long)(millis() - stopped) * 30 / 100) <= 10);
+	CHECK(rested > 60000);
+
+	// somebody comes in: the rest ends and the fan runs the refilled budget out
+	simSetInput(pirPin, HIGH);
+	for (int second = 0; second < 300; second++) {
+		hostRunFor(1000);
+		follow(model, from, time, running, resting);
+		resting = fanProtect;
+		worst = max(worst, labs(fanBudget() - model.millisecs()));
+	}
+	simSetInput(pirPin, LOW);
+
+	// the model goes by the relay, the sketch settles the budget a few millisecs later in the same loop
+	CHECK(worst < 10);
+
+	printf("fan_budget: %ld ms refilled, the largest difference to the model %ld ms\n", rested, worst);
+	return hostResult();
+}
@@ -0,0 +1,40 @@
+/*
+ * The time to the first decision counts from power-on to the first fan decision made on a valid reading:
+ * a button pressed before it and a failed first reading do not count.
+ */
+#include "harness.h"
+
+// the DHT does not answer or the SHT3x answers with a broken CRC
+void sensorFails(bool fail) {
+	simDhtFail = fail;
+	simShtBadCrc = fail;
+}
+
+int main() {
+	simHumidity = 60;
+	simTemperature = 22.5;
+	sensorFails(true);
+
+	setup();
+
+	// the fan button forces the fan before anything was read
+	hostPress(buttonFan);
+	CHECK(fanForced != 0);
+	CHECK(firstDecisionTime == 0);
+
+	// the sensor does not answer; the sketch keeps trying
+	hostRunUntil(2500);
+	CHECK(sensorFailed);
+	CHECK(firstDecisionTime == 0);
+	CHECK(modbusInputRegister(21) == 0);
+
+	sensorFails(false);
+	hostRunUntil(8000);
+	CHECK(!sensorFailed);
+	CHECK(firstDecisionTime > 2500);
+	CHECK(firstDecisionTime < 2500 + 2000 + dhtRetryInterval);     // the DHT library repeats a result for 2 secs
+	CHECK(modbusInputRegister(21) == firstDecisionTime);
+
+	printf("first_decision: %lu ms with the first reading failed\n", firstDecisionTime);
+	return hostResult();
+}
@@ -0,0 +1,91 @@
+/*
+ * The memory report of a build variant and the regression check against host/memory_baseline.txt:
+ * the static RAM of each subsystem may not grow beyond the baseline (sizes as compiled for the host;
+ * the byte arrays are the same on the AVR, the library objects differ).
+ * The high-water scan runs on a stack and heap laid out in the simulated SRAM, with the heap shrunk
+ * by free() after it had grown: the gap is measured from the highest heap end there has been.
+ *
+ * memory <variant> <baseline file> [<report file>]
+ */
+#include "harness.h"
+
+struct Subsystem {
+	const char* name;
+	unsigned int bytes;
+};
+
+const Subsystem subsystems[] = {
+	{"settings", ramSettings},
+	{"display", ramDisplay},
+	{"sensor", ramSensor},
+	{"control", ramControl},
+	{"trace", ramTrace},
+	{"serial", ramSerial},
+	{"total", ramSubsystems},
+};
+
+// the bytes of the subsystem in the baseline of the variant; -1 -> not there
+long baseline(const char* path, const char* variant, const char* name) {
+	FILE* f = fopen(path, "r");
+	char v[32], n[32];
+	long bytes, found = -1;
+
+	if (!f) {
+		return -1;
+	}
+	while (fscanf(f, "%31s %31s %ld", v, n, &bytes) == 3) {
+		if (strcmp(v, variant) == 0 && strcmp(n, name) == 0) {
+			found = bytes;
+		}
+	}
+	fclose(f);
+	return found;
+}
+
+// fill [from, to) with value and a stray memoryPaint byte every 16 bytes
+void use(char* from, char* to, char value) {
+	for (char* p = from; p < to; p++) {
+		*p = ((p - from) % 16 == 5) ? memoryPaint : value;
+	}
+}
+
+int main(int argc, char** argv) {
+	if (argc < 3) {
+		printf("usage: memory <variant> <baseline file> [<report file>]\n");
+		return 2;
+	}
+	const char* variant = argv[1];
+
+	simHumidity = 40;
+	setup();
+	hostRunUntil(3000);
+
+	// the stack went 300 bytes deep; the heap grew by 200 bytes, then free() gave back 150 of them
+	char* sp = (char*)SP;
+	use(sp - 300, sp, 0x11);
+	use(simHeapStart, simHeapStart + 200, 0x22);
+	simBrkval = simHeapStart + 50;
+	CHECK(memoryHeapSize() == 50);
+	CHECK(memoryFree() == (unsigned int)(sp - simHeapStart - 50));
+	CHECK(memoryStackMin() == (unsigned int)((sp - 300) - (simHeapStart + 200)));
+
+	// the report, in the format of the baseline
+	FILE* report = argc > 3 ? fopen(argv[3], "w") : 0;
+	for (const Subsystem &s : subsystems) {
+		long limit = baseline(argv[2], variant, s.name);
+		printf("memory: %s %s %u bytes (baseline %ld)\n", variant, s.name, s.bytes, limit);
+		if (report) {
+			fprintf(report, "%s %s %u\n", variant, s.name, s.bytes);
+		}
+		if (limit < 0 || s.bytes > (unsigned long)limit) {
+			printf("memory: %s %s grew beyond the baseline; if that is meant, copy the report into %s\n", variant, s.name, argv[2]);
+			hostFailures++;
+		}
+	}
+	if (report) {
+		fclose(report);
+	}
+	printf("memory: %s free %u, smallest gap %u, heap %u, free list %u, budget %u\n",
+		variant, memoryFree(), memoryStackMin(), memoryHeapSize(), memoryFreeList(), memoryBudget);
+	return hostResult();
+}
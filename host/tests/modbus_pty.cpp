@@ -0,0 +1,204 @@
+/*
+ * Modbus RTU through a pseudo-terminal: the test talks to the controller the way a supervisor does
+ * (a raw serial port) and the simulated UART is wired to the other end of the pty.
+ * Checks the functions 03, 04, 06 and 16, the exceptions, the frames that get no response,
+ * the RS-485 driver timing and the frame separation.
+ */
+#include <fcntl.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include "harness.h"
+
+int port;               // the supervisor's end
+int line;               // the controller's end
+size_t forwarded = 0;   // simUartSent bytes already written to the line
+
+// Modbus CRC-16 (polynomial 0xA001 reflected, initial value 0xFFFF), low byte first on the line
+unsigned int crc16(const std::vector<uint8_t> &data) {
+	unsigned int crc = 0xFFFF;
+
+	for (uint8_t b : data) {
+		crc ^= b;
+		for (int i = 0; i < 8; i++) {
+			crc = (crc & 1) ? (crc >> 1) ^ 0xA001 : crc >> 1;
+		}
+	}
+	return crc;
+}
+
+std::vector<uint8_t> frame(std::vector<uint8_t> data) {
+	unsigned int crc = crc16(data);
+	data.push_back(crc & 0xFF);
+	data.push_back(crc >> 8);
+	return data;
+}
+
+// run the controller for ms; what the supervisor wrote arrives on RX, what the controller sends goes back
+void pump(unsigned long ms) {
+	unsigned long end = millis() + ms;
+
+	while (millis() < end) {
+		uint8_t buffer[64];
+		ssize_t n = read(line, buffer, sizeof(buffer));
+		if (n > 0) {
+			simUartReceive(buffer, n);
+		}
+		loop();
+		for (; forwarded < simUartSent.size(); forwarded++) {
+			CHECK(write(line, &simUartSent[forwarded].value, 1) == 1);
+		}
+	}
+}
+
+// send a request and return the response (empty -> none within 50 ms)
+std::vector<uint8_t> request(const std::vector<uint8_t> &data) {
+	CHECK(write(port, data.data(), data.size()) == (ssize_t)data.size());
+	pump(50);
+
+	std::vector<uint8_t> response;
+	uint8_t buffer[64];
+	ssize_t n;
+	while ((n = read(port, buffer, sizeof(buffer))) > 0) {
+		response.insert(response.end(), buffer, buffer + n);
+	}
+	if (!response.empty()) {
+		std::vector<uint8_t> body(response.begin(), response.end() - 2);
+		CHECK(frame(body) == response);
+	}
+	return response;
+}
+
+std::vector<uint8_t> readRegisters(uint8_t function, unsigned int start, unsigned int count) {
+	return request(frame({modbusAddress, function, (uint8_t)(start >> 8), (uint8_t)start, (uint8_t)(count >> 8), (uint8_t)count}));
+}
+
+unsigned int value(const std::vector<uint8_t> &response, int i) {
+	return response[3 + 2*i] << 8 | response[4 + 2*i];
+}
+
+// the exception code of a response (0 -> not an exception)
+uint8_t exception(const std::vector<uint8_t> &response) {
+	return (response.size() == 5 && (response[1] & 0x80)) ? response[2] : 0;
+}
+
+// the RS-485 driver went ON before the first byte of the last response and OFF right after its stop bit
+void checkDriver(size_t first) {
+	unsigned long on = 0, off = 0;
+
+	for (const SimPinChange &c : simPinChanges) {
+		if (c.pin == modbusDePin) {
+			(c.level == HIGH ? on : off) = c.time;
+		}
+	}
+	unsigned long start = simUartSent[first].end - simUartByteTime();
+	unsigned long stop = simUartSent.back().end;
+	CHECK(on <= start);
+	CHECK(off >= stop && off - stop < simUartByteTime());
+}
+
+int main() {
+	// a raw serial port on the pty; both ends do not block
+	port = posix_openpt(O_RDWR | O_NOCTTY);
+	CHECK(port >= 0 && grantpt(port) == 0 && unlockpt(port) == 0);
+	line = open(ptsname(port), O_RDWR | O_NOCTTY);
+	CHECK(line >= 0);
+	struct termios raw;
+	tcgetattr(line, &raw);
+	cfmakeraw(&raw);
+	tcsetattr(line, TCSANOW, &raw);
+	fcntl(port, F_SETFL, O_NONBLOCK);
+	fcntl(line, F_SETFL, O_NONBLOCK);
+	if (hostFailures > 0) {
+		return hostResult();
+	}
+
+	simHumidity = 60;
+	simTemperature = 22.5;
+	setup();
+
+	// between the DHT readings, which block the interrupts
+	pump(2500 - millis());
+
+	// 04: the state of the controller
+	size_t first = simUartSent.size();
+	std::vector<uint8_t> r = readRegisters(4, 0, modbusInputRegisters);
+	CHECK(r.size() == 5 + 2 * modbusInputRegisters);
+	if (r.size() == 5 + 2 * modbusInputRegisters) {
+		CHECK(r[2] == 2 * modbusInputRegisters);
+		CHECK(value(r, 0) == 600);
+		CHECK(value(r, 1) == 225);
+		CHECK(value(r, 2) == 1);
+		CHECK(value(r, 21) == firstDecisionTime);
+	}
+	checkDriver(first);
+
+	// 03: the settings
+	r = readRegisters(3, 0, sizeof(defaultSettings));
+	CHECK(r.size() == 5 + 2 * sizeof(defaultSettings));
+	for (byte i = 0; i < sizeof(defaultSettings) && r.size() == 5 + 2 * sizeof(defaultSettings); i++) {
+		CHECK(value(r, i) == eepromSettings[i]);
+	}
+
+	// 06 and 16: the responses repeat the request
+	pump(5000 - 2500);
+	first = simUartSent.size();
+	std::vector<uint8_t> write06 = frame({modbusAddress, 6, 0, 2, 0, 55});
+	CHECK(request(write06) == write06);
+	CHECK(eepromSettings[2] == 55);
+	checkDriver(first);
+	r = request(frame({modbusAddress, 16, 0, 4, 0, 2, 4, 0, 7, 0, 9}));
+	CHECK(r == frame({modbusAddress, 16, 0, 4, 0, 2}));
+	CHECK(eepromSettings[4] == 7 && eepromSettings[5] == 9);
+
+	// exceptions; start + count wraps around on the 16 bit int of the target (not on the host,
+	// so here these only check the edges of the ranges)
+	CHECK(exception(readRegisters(5, 0, 1)) == 1);
+	CHECK(exception(readRegisters(3, 0, 0)) == 2);
+	CHECK(exception(readRegisters(3, sizeof(defaultSettings), 1)) == 2);
+	CHECK(exception(readRegisters(3, 0xFFFF, 1)) == 2);
+	CHECK(exception(readRegisters(3, 1, 0xFFFF)) == 2);
+	CHECK(exception(readRegisters(4, 0xFFFF, 2)) == 2);
+	CHECK(exception(readRegisters(4, modbusInputRegisters - 1, 2)) == 2);
+	CHECK(exception(request(frame({modbusAddress, 16, 0xFF, 0xFF, 0, 1, 2, 0, 1}))) == 2);
+	CHECK(exception(request(frame({modbusAddress, 16, 0, 1, 0xFF, 0xFF, 0xFE, 0, 1}))) == 2);
+	CHECK(exception(request(frame({modbusAddress, 6, 0, 1, 0x10, 0}))) == 3);
+	CHECK(eepromSettings[1] == defaultSettings[1]);
+	// a bad value in 16 changes none of the settings, not even the ones before it
+	unsigned long writes = simEepromWrites[4];
+	CHECK(exception(request(frame({modbusAddress, 16, 0, 4, 0, 2, 4, 0, 5, 0x01, 0x2C}))) == 3);
+	pump(100);
+	CHECK(eepromSettings[4] == 7 && eepromSettings[5] == 9);
+	CHECK(simEepromWrites[4] == writes);
+
+	// no response: a broken CRC, another controller, a broadcast (which is still executed)
+	std::vector<uint8_t> broken = frame({modbusAddress, 3, 0, 0, 0, 1});
+	broken.back() ^= 1;
+	CHECK(request(broken).empty());
+	CHECK(readRegisters(4, 0, 1).size() == 7);
+	CHECK(request(frame({modbusAddress + 1, 3, 0, 0, 0, 1})).empty());
+	CHECK(request(frame({0, 6, 0, 2, 0, 50})).empty());
+	CHECK(eepromSettings[2] == 50);
+
+	// a request for another controller and one for this controller come while the loop is busy
+	// (nothing runs but the interrupts); the silence between them still separates the frames
+	pump(10000 + 2500 - millis());
+	std::vector<uint8_t> other = frame({modbusAddress + 1, 4, 0, 0, 0, 1});
+	std::vector<uint8_t> mine = frame({modbusAddress, 4, 0, 1, 0, 1});
+	simUartReceive(other.data(), other.size());
+	simAdvance(other.size() * simUartByteTime() + 2 * modbusSilence);
+	simUartReceive(mine.data(), mine.size());
+	simAdvance(mine.size() * simUartByteTime() + 2 * modbusSilence);
+	first = simUartSent.size();
+	forwarded = first;
+	pump(50);
+	CHECK(simUartSent.size() == first + 7);
+	if (simUartSent.size() == first + 7) {
+		CHECK(simUartSent[first + 3].value == 0 && simUartSent[first + 4].value == 225);
+	}
+	checkDriver(first);
+
+	CHECK(simUartOverruns == 0);
+	printf("modbus_pty: %u bytes sent at %lu us a byte\n", (unsigned int)simUartSent.size(), simUartByteTime());
+	return hostResult();
+}
@@ -0,0 +1,75 @@
+/*
+ * The settings in the EEPROM across reboots: an empty EEPROM gets the defaults, an EEPROM written
+ * before the settings count was stored keeps its settings and gets the defaults of the new ones,
+ * and a setting at 255 (the brightness wrapped around below 0 in the menu) is kept.
+ */
+#include "harness.h"
+
+struct Boot {
+	uint8_t eeprom[1024];       // before the boot and then after it
+	byte values[settingsCount];    // eepromSettings after the boot
+	int failures;               // checks failed in the boot
+};
+
+// boot with the EEPROM image, change the brightness by steps in the menu (< 0 -> DOWN), let the EEPROM be written
+void boot(Boot &b, int steps) {
+	memcpy(simEeprom, b.eeprom, sizeof(simEeprom));
+	simHumidity = 40;
+	setup();
+	hostRunUntil(3000);
+
+	if (steps != 0) {
+		hostPress(buttonSettings, 300);
+		for (int i = 0; i < abs(steps); i++) {
+			hostPress(steps > 0 ? buttonUp : buttonDown, 300);
+		}
+		for (byte i = 0; i < settingsCount; i++) {
+			hostPress(buttonSettings, 300);
+		}
+		CHECK(!modeSettings);
+	}
+	hostRunFor(2000);
+
+	memcpy(b.eeprom, simEeprom, sizeof(simEeprom));
+	memcpy(b.values, eepromSettings, settingsCount);
+}
+
+bool isolatedBoot(Boot &b, int steps) {
+	return hostIsolated(b, [steps](Boot &result) { boot(result, steps); });
+}
+
+int main() {
+	// an empty EEPROM
+	Boot b;
+	memset(b.eeprom, 0xFF, sizeof(b.eeprom));
+	CHECK(isolatedBoot(b, 0));
+	for (byte i = 0; i < settingsCount; i++) {
+		CHECK(b.values[i] == defaultSettings[i]);
+		CHECK(b.eeprom[i] == defaultSettings[i]);
+	}
+	CHECK(b.eeprom[settingsCountAddress] == settingsCount);
+
+	// the brightness goes from 7 down below 0 to 255 and stays there after a reboot
+	CHECK(isolatedBoot(b, -(defaultSettings[0] + 1)));
+	CHECK(b.values[0] == 255);
+	CHECK(b.eeprom[0] == 255);
+	CHECK(isolatedBoot(b, 0));
+	CHECK(b.values[0] == 255);
+	for (byte i = 1; i < settingsCount; i++) {
+		CHECK(b.values[i] == defaultSettings[i]);
+	}
+
+	// written by the firmware before the count: its settings stay, the newer ones get their defaults
+	memset(b.eeprom, 0xFF, sizeof(b.eeprom));
+	const byte legacy[settingsLegacyCount] = {120, 80, 55, false, 3, 10, 4, 2};
+	memcpy(b.eeprom, legacy, sizeof(legacy));
+	CHECK(isolatedBoot(b, 0));
+	for (byte i = 0; i < settingsCount; i++) {
+		CHECK(b.values[i] == (i < settingsLegacyCount ? legacy[i] : defaultSettings[i]));
+		CHECK(b.eeprom[i] == b.values[i]);
+	}
+	CHECK(b.eeprom[settingsCountAddress] == settingsCount);
+
+	printf("settings_eeprom: checked\n");
+	return hostResult();
+}
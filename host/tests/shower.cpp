@@ -0,0 +1,125 @@
+/*
+ * Two showers in the simulated bathroom, once with the rise trigger OFF and once at 3 %/min.
+ * Starting on the slope just below the limit takes the humidity down sooner: a lower peak and back near
+ * the limit sooner after the shower. The early release near the limit stops the fan sooner, so it runs
+ * for a shorter time after the shower and in all, without switching the relay back and forth around the limit.
+ * A third room dries to 62.5 %, just above the limit: the release ends once the humidity levels off,
+ * so the fan runs again instead of staying OFF above the limit.
+ */
+#include "harness.h"
+#include "room.h"
+
+struct Run {
+	float peak;                 // the highest humidity
+	unsigned long settle;       // millisecs from the end of a shower until the humidity is down to the limit + riseNearBand
+	unsigned long tail;         // millisecs the fan ran after the end of a shower
+	unsigned long fanTime;      // millisecs the fan ran in all
+	unsigned int switches;      // relay changes
+	int failures;
+};
+
+const byte limit = 60;
+
+void shower(Run &r, byte trigger) {
+	Room room;
+
+	for (byte i = 0; i < settingsCount; i++) {
+		simEeprom[i] = defaultSettings[i];
+	}
+	simEeprom[settingsCountAddress] = settingsCount;
+	simEeprom[2] = limit;
+	simEeprom[4] = 1;           // fan lock (min)
+	simEeprom[5] = 60;          // fan max run time: the budget does not interfere
+	simEeprom[8] = trigger;
+	simHumidity = room.outside;
+
+	setup();
+	room.runUntil(60000);
+	unsigned long changes = simPinChanges.size();
+
+	r = Run();
+	for (int n = 0; n < 2; n++) {
+		// 8 minutes of shower, then the room dries
+		unsigned long end = millis() + 8 * 60000UL;
+		room.shower = true;
+		room.runUntil(end);
+		room.shower = false;
+		r.peak = max(r.peak, simHumidity);
+
+		bool settled = false;
+		while (millis() < end + 30 * 60000UL) {
+			room.runUntil(millis() + 1000);
+			r.peak = max(r.peak, simHumidity);
+			if (!settled && simHumidity <= limit + riseNearBand) {
+				r.settle += millis() - end;
+				settled = true;
+			}
+			if (hostFanOn()) {
+				r.tail += 1000;
+			}
+		}
+	}
+	r.fanTime = room.fanTime;
+	for (size_t i = changes; i < simPinChanges.size(); i++) {
+		if (simPinChanges[i].pin == relayFan) {
+			r.switches++;
+		}
+	}
+}
+
+// one shower, then the room levels off above the limit; the tail is the fan time from 20 to 50 minutes after it
+void level(Run &r) {
+	Room room;
+
+	for (byte i = 0; i < settingsCount; i++) {
+		simEeprom[i] = defaultSettings[i];
+	}
+	simEeprom[settingsCountAddress] = settingsCount;
+	simEeprom[2] = limit;
+	simEeprom[4] = 1;
+	simEeprom[5] = 60;
+	simEeprom[8] = 3;
+	simHumidity = room.outside;
+
+	setup();
+	room.runUntil(60000);
+
+	r = Run();
+	room.shower = true;
+	room.runUntil(millis() + 8 * 60000UL);
+	room.shower = false;
+	room.outside = limit + 2.5;
+	room.runUntil(millis() + 20 * 60000UL);
+	unsigned long before = room.fanTime;
+	room.runUntil(millis() + 30 * 60000UL);
+	r.tail = room.fanTime - before;
+	r.peak = simHumidity;
+}
+
+bool isolatedShower(Run &r, byte trigger) {
+	return hostIsolated(r, [trigger](Run &result) { shower(result, trigger); });
+}
+
+int main() {
+	Run off, on;
+	CHECK(isolatedShower(off, 0));
+	CHECK(isolatedShower(on, 3));
+
+	printf("shower: trigger OFF: peak %.1f %%, settled in %lu s, fan %lu s after the showers, %lu s in all, %u relay switches\n",
+		off.peak, off.settle / 1000, off.tail / 1000, off.fanTime / 1000, off.switches);
+	printf("shower: trigger 3:   peak %.1f %%, settled in %lu s, fan %lu s after the showers, %lu s in all, %u relay switches\n",
+		on.peak, on.settle / 1000, on.tail / 1000, on.fanTime / 1000, on.switches);
+
+	CHECK(on.peak < off.peak);
+	CHECK(on.settle < off.settle);
+	CHECK(on.tail < off.tail);
+	CHECK(on.fanTime < off.fanTime);
+	CHECK(off.switches == 4);   // ON and OFF for each shower
+	CHECK(on.switches == 4);
+
+	Run flat;
+	CHECK(hostIsolated(flat, level));
+	printf("shower: level at %.1f %%: fan %lu s from 20 to 50 min after the shower\n", flat.peak, flat.tail / 1000);
+	CHECK(flat.tail > 25 * 60000UL);
+	return hostResult();
+}
@@ -0,0 +1,105 @@
+/*
+ * The SHT3x backend on the simulated I2C bus: one single shot measurement a second, the result
+ * decoded and checked with its CRC, a broken CRC and a missing sensor reported (and traced) as a failed
+ * reading, and the loop never waiting for the bus.
+ */
+#include "harness.h"
+
+// the DHT records in the trace from the record at pos on: failed readings and valid ones
+void traceReadings(byte pos, unsigned int &failed, unsigned int &valid) {
+	failed = 0;
+	valid = 0;
+	while (pos != traceHead) {
+		byte event = traceBuffer[pos] & 0x0F;
+		byte arg = traceBuffer[pos] >> 4;
+		pos++;
+		if (event != traceEventDht) {
+			traceReadVarint(pos);
+		}
+		byte values = (event == traceEventDht) ? (arg == 0 ? 2 : arg == 2 ? 1 : 0)
+			: (event == traceEventButton || event == traceEventAmbient) ? 1
+			: (event == traceEventSetting) ? 3 : 0;
+		if (event == traceEventState) {
+			pos += traceBuffer[pos] + 1;
+		}
+		for (byte i = 0; i < values; i++) {
+			traceReadVarint(pos);
+		}
+		if (event == traceEventDht) {
+			(arg == 1) ? failed++ : valid++;
+		}
+	}
+}
+
+// how much longer than its delay(1) the longest loop() took; the loops run until millis() reaches ms
+unsigned long runTimed(unsigned long ms) {
+	unsigned long longest = 0;
+
+	while (millis() < ms) {
+		unsigned long start = simMicros;
+		unsigned long writes = simLcdBusWrites;
+		loop();
+		// the display writes are not the sensor's business
+		if (simLcdBusWrites == writes) {
+			longest = max(longest, simMicros - start - 1000);
+		}
+	}
+	return longest;
+}
+
+int main() {
+	simHumidity = 55.3;
+	simTemperature = 21.7;
+
+	setup();
+	unsigned long longest = runTimed(10500);
+
+	// one measurement a second, the result within the sensor's resolution
+	CHECK(!sensorFailed);
+	CHECK(simShtMeasurements >= 10 && simShtMeasurements <= 11);
+	CHECK(abs(lastHumidity - 553) <= 1);
+	CHECK(abs(lastTemperature - 217) <= 1);
+	CHECK(longest < 1000);
+
+	// a broken CRC is a failed reading; the fan keeps its last decision
+	simHumidity = 30;
+	simShtBadCrc = true;
+	bool fan = hostFanOn();
+	byte from = traceHead;
+	runTimed(13000);
+	CHECK(sensorFailed);
+	CHECK(abs(lastHumidity - 553) <= 1);
+	CHECK(hostFanOn() == fan);
+	// each failed reading is traced as a failure, nothing else as a reading
+	unsigned int failed, valid;
+	traceReadings(from, failed, valid);
+	CHECK(failed >= 2 && valid == 0);
+	CHECK(abs(traceLastHumidity - 553) <= 1);
+
+	simShtBadCrc = false;
+	runTimed(15000);
+	CHECK(!sensorFailed);
+	CHECK(abs(lastHumidity - 300) <= 1);
+
+	// the sensor is unplugged: its address is not acknowledged and the bus is left free
+	simShtPresent = false;
+	unsigned long measurements = simShtMeasurements;
+	from = traceHead;
+	unsigned long unplugged = runTimed(18000);
+	CHECK(sensorFailed);
+	CHECK(simShtMeasurements == measurements);
+	CHECK(twiState != twiBusy);
+	traceReadings(from, failed, valid);
+	CHECK(failed >= 2 && valid == 0);
+
+	simShtPresent = true;
+	simHumidity = 70;
+	unsigned long back = runTimed(20000);
+	CHECK(!sensorFailed);
+	CHECK(abs(lastHumidity - 700) <= 1);
+	CHECK(unplugged < 1000 && back < 1000);
+
+	printf("sht3x_bus: %lu measurements, %lu bus bytes, the longest loop without display writes %lu us over its delay\n",
+		simShtMeasurements, simTwiBytes, max(longest, max(unplugged, back)));
+	return hostResult();
+}
@@ -0,0 +1,92 @@
+/*
+ * EEPROM wear of the snapshots: hours of an idle bathroom write no snapshot after the first one,
+ * a shower writes them while the fan runs and rests, a night with the light OFF after the rest writes
+ * at most one, and a reset in the middle of the rest restores the protection from the EEPROM.
+ */
+#include "harness.h"
+
+struct Wear {
+	unsigned long first;        // bytes written to the snapshot slots after the power-up
+	unsigned long idle;         // in 3 idle hours
+	unsigned long busy;         // in a shower
+	unsigned long night;        // in 8 hours with the light OFF after the rest
+	unsigned long settled;      // in 3 idle hours after the shower
+	uint8_t resting[1024];      // the EEPROM in the middle of the rest
+	bool fanProtect;            // after the reset in the middle of the rest
+	bool fanOn;
+	int failures;
+};
+
+// writes to the snapshot slots so far
+unsigned long snapshotWrites() {
+	unsigned long writes = 0;
+
+	for (int i = snapshotAddress; i < snapshotAddress + 2 * snapshotSlotSize; i++) {
+		writes += simEepromWrites[i];
+	}
+	return writes;
+}
+
+void bathroom(Wear &w) {
+	simHumidity = 30;
+	setup();
+
+	// the first snapshot after the power-up, then three idle hours
+	hostRunUntil(10 * 60000UL);
+	w.first = snapshotWrites();
+	hostRunUntil(3 * 3600000UL);
+	w.idle = snapshotWrites() - w.first;
+
+	// a shower: the fan runs its budget out and rests (the light is OFF)
+	simHumidity = 80;
+	hostRunFor(minutesToMillis(eepromSettings[5]) + 20000);
+	CHECK(fanProtect);
+	w.busy = snapshotWrites() - w.first - w.idle;
+	memcpy(w.resting, simEeprom, sizeof(w.resting));
+
+	// the rest ends, but nobody comes in all night: the fan waits for the light
+	hostRunFor(minutesToMillis(eepromSettings[6]));
+	unsigned long rested = snapshotWrites();
+	hostRunFor(8 * 3600000UL);
+	CHECK(fanProtect);
+	w.night = snapshotWrites() - rested;
+
+	// dry again: somebody comes in, the rest ends, the budget fills up and the snapshots stop
+	simHumidity = 30;
+	simSetInput(pirPin, HIGH);
+	hostRunFor(20 * 60000UL);
+	simSetInput(pirPin, LOW);
+	hostRunFor(30 * 60000UL);
+	unsigned long writes = snapshotWrites();
+	hostRunFor(3 * 3600000UL);
+	w.settled = snapshotWrites() - writes;
+}
+
+// the power comes back with the EEPROM of the rest
+void reset(Wear &w) {
+	memcpy(simEeprom, w.resting, sizeof(simEeprom));
+	simHumidity = 80;
+	setup();
+	hostRunFor(2000);
+	w.fanProtect = fanProtect;
+	w.fanOn = hostFanOn();
+}
+
+int main() {
+	Wear w;
+
+	CHECK(hostIsolated(w, bathroom));
+	CHECK(w.first > 0 && w.first <= 2 * snapshotSize);
+	CHECK(w.idle == 0);
+	CHECK(w.busy > 0);
+	CHECK(w.night <= snapshotSize);
+	CHECK(w.settled == 0);
+
+	CHECK(hostIsolated(w, reset));
+	CHECK(w.fanProtect);
+	CHECK(!w.fanOn);
+
+	printf("snapshot_wear: %lu bytes written at the power-up, %lu in 3 idle hours, %lu in a shower, %lu in a night after it, %lu in 3 idle hours after that\n",
+		w.first, w.idle, w.busy, w.night, w.settled);
+	return hostResult();
+}
@@ -0,0 +1,157 @@
+/*
+ * Record more than half an hour of a bathroom (showers, motion, the buttons, the settings menu,
+ * a sensor failure, the daylight) with TRACE_SERIAL, dump the trace the way a user does it
+ * (hold UP and press settings) and save the dumps for trace_replay: the first one after the fan
+ * has run its budget out, rested and gone OFF, the second one after a setting changed in the menu.
+ * trace_scenario <dump file> <menu dump file>
+ */
+#include "harness.h"
+#include "room.h"
+
+Room room;
+
+// motion in front of the PIR sensor for ms
+void motion(unsigned long ms) {
+	simSetInput(pirPin, HIGH);
+	room.runUntil(millis() + ms);
+	simSetInput(pirPin, LOW);
+}
+
+void press(byte pin) {
+	simSetInput(pin, HIGH);
+	room.runUntil(millis() + 150);
+	simSetInput(pin, LOW);
+	room.runUntil(millis() + 600);
+}
+
+// dump the trace the way a user does it (hold UP and press settings) into the file
+bool dump(const char* path) {
+	simSerialOut.clear();
+	simSetInput(buttonUp, HIGH);
+	press(buttonSettings);
+	simSetInput(buttonUp, LOW);
+
+	CHECK(simSerialOut.size() > 16 + settingsCount);
+	CHECK(simSerialOut[0] == 'T' && simSerialOut[1] == 'R');
+	CHECK(traceBaseTime > 0);   // the ring buffer has wrapped around
+
+	FILE* f = fopen(path, "wb");
+	if (!f || fwrite(simSerialOut.data(), 1, simSerialOut.size(), f) != simSerialOut.size()) {
+		printf("cannot write %s\n", path);
+		return false;
+	}
+	fclose(f);
+	printf("trace_scenario: %u bytes dumped into %s\n", (unsigned int)simSerialOut.size(), path);
+	return true;
+}
+
+int main(int argc, char** argv) {
+	if (argc != 3) {
+		printf("usage: trace_scenario <dump file> <menu dump file>\n");
+		return 2;
+	}
+
+	// the settings as left by the user: humidity limit 60 %, dark below 100; the room is dark
+	for (byte i = 0; i < sizeof(defaultSettings); i++) {
+		simEeprom[i] = defaultSettings[i];
+	}
+	simEeprom[2] = 60;
+	simEeprom[5] = 1;           // fan max run time (min)
+	simEeprom[9] = 100;
+	simEeprom[settingsCountAddress] = settingsCount;
+	simHumidity = 45;
+	simAmbientAdc = 50 << 2;
+
+	setup();
+	room.runUntil(40000);
+	motion(8000);
+
+	// a shower with the door closed; the fan runs into its run budget and rests
+	room.shower = true;
+	for (int i = 0; i < 4; i++) {
+		room.runUntil(millis() + 100000);
+		motion(5000);
+	}
+	room.shower = false;
+	room.runUntil(10 * 60000UL);
+
+	// the fan button: forced ON, forced OFF, forced ON
+	press(buttonFan);
+	room.runUntil(11 * 60000UL);
+	press(buttonFan);
+	room.runUntil(12 * 60000UL);
+	press(buttonFan);
+	room.runUntil(13 * 60000UL);
+	press(buttonLight);
+
+	// the brightness goes up by 2 in the settings menu
+	room.runUntil(16 * 60000UL);
+	press(buttonSettings);
+	press(buttonUp);
+	press(buttonUp);
+	for (byte i = 0; i < settingsCount; i++) {
+		press(buttonSettings);
+	}
+	CHECK(!modeSettings);
+
+	// the sensor drops out for a while
+	room.runUntil(20 * 60000UL);
+	simDhtFail = true;
+	room.runUntil(millis() + 12000);
+	simDhtFail = false;
+
+	// another shower, nobody moves: the light goes OFF after its lock time
+	room.shower = true;
+	room.runUntil(24 * 60000UL);
+	room.shower = false;
+	room.runUntil(30 * 60000UL);
+	CHECK(simOutput(ledPin) == LOW);
+
+	// somebody comes in by daylight (the light stays OFF) and showers, then forces the fan ON for its run time
+	simAmbientAdc = 1023;
+	room.runUntil(millis() + 2000);
+	motion(3000);
+	CHECK(simOutput(ledPin) == LOW);
+	room.shower = true;
+	room.showerRate = 30;
+	room.runUntil(millis() + 30000);
+	press(buttonFan);
+	room.runUntil(millis() + 8000);
+	room.shower = false;
+	room.runUntil(millis() + 3 * 60000UL);
+
+	// what the first dump holds: the sun goes down, the next motion turns the light ON and somebody showers;
+	// the fan runs its budget out, rests and is OFF when the room has dried
+	simAmbientAdc = 50 << 2;
+	room.runUntil(millis() + 2000);
+	motion(3000);
+	CHECK(simOutput(ledPin) == HIGH);
+	room.shower = true;
+	room.showerRate = 20;
+	room.runUntil(millis() + 20000);
+	room.shower = false;
+	while (statusLine != statusFanOff && millis() < 40 * 60000UL) {
+		room.runUntil(millis() + 1000);
+	}
+	CHECK(statusLine == statusFanOff);
+	room.runUntil(millis() + 5000);
+	if (!dump(argv[1])) {
+		return 2;
+	}
+
+	// what the second dump holds: the dark level goes down by a step in the settings menu
+	for (byte i = 0; i < 10; i++) {
+		press(buttonSettings);
+	}
+	press(buttonDown);
+	press(buttonSettings);
+	CHECK(!modeSettings);
+	CHECK(eepromSettings[9] < 100);
+	room.runUntil(millis() + 5000);
+	if (!dump(argv[2])) {
+		return 2;
+	}
+
+	printf("trace_scenario: fan ran %lu s\n", room.fanTime / 1000);
+	return hostResult();
+}
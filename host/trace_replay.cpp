@@ -0,0 +1,520 @@
+/*
+ * Replay a trace dumped by traceDump() through the sketch and compare what the sketch does
+ * with what the unit did: the fan relay, the light relay and the status line.
+ *
+ * trace_replay <dump file> [-v] [-w <seconds>] [-r]
+ *  -v  print each change
+ *  -w  the replay from the checkpoint has to take at least this long
+ *  -r  the unit has to show the fan ON, resting and OFF in the replayed part, in that order
+ *
+ * The replay starts at the oldest checkpoint in the dump: the state is restored from it,
+ * then the recorded inputs are fed to the sketch at their times (the DHT readings in order,
+ * one per reading the sketch takes, the ambient light, the settings written over Modbus)
+ * and loop() runs on the simulated clock. The settings changed in the menu are compared too.
+ * Exit code: 0 -> the same changes in the same order, each within replayTolerance; 1 -> they differ; 2 -> bad dump.
+ */
+#include "harness.h"
+
+const unsigned long replayTolerance = 1500;    // millisecs a change may move (the PIR is read once a second)
+const unsigned long replayPirLead = 500;       // the PIR output and the ambient light are fed this much before they were read
+const unsigned long replayBurst = 20;          // status lines closer than this came from one loop(); only the last one stays on the display
+
+struct Record {
+	unsigned long time;         // millis() on the unit
+	byte event;
+	byte arg;
+	long a, b;                  // DHT: absolute humidity and temperature; button: pin; ambient: level; setting: address and value
+	byte previous;              // setting: the value it replaced
+	std::vector<unsigned long> state;   // checkpoint payload as read
+};
+
+struct Change {
+	unsigned long time;
+	char what;                  // 'F' fan relay pin, 'L' light relay pin, 'S' status line, 'W' setting (address * 256 + value)
+	int value;
+};
+
+std::vector<uint8_t> dump;
+std::vector<Record> records;
+byte dumpSettings[32];
+byte dumpSettingsCount = 0;
+size_t nextDht = 0;             // the next DHT record the sketch reads
+
+bool readDump(const char* path) {
+	FILE* f = fopen(path, "rb");
+	if (!f) {
+		printf("cannot read %s\n", path);
+		return false;
+	}
+	int c;
+	while ((c = fgetc(f)) != EOF) {
+		dump.push_back(c);
+	}
+	fclose(f);
+	return true;
+}
+
+unsigned long readVarint(size_t &pos) {
+	unsigned long value = 0;
+	byte shift = 0;
+	byte b;
+
+	do {
+		if (pos >= dump.size()) {
+			throw "the dump ends inside a record";
+		}
+		b = dump[pos++];
+		value |= (unsigned long)(b & 0x7F) << shift;
+		shift += 7;
+	} while (b & 0x80);
+	return value;
+}
+
+unsigned long readLittleEndian(size_t &pos, byte bytes) {
+	unsigned long value = 0;
+
+	for (byte i = 0; i < bytes; i++) {
+		value |= (unsigned long)dump[pos++] << (8 * i);
+	}
+	return value;
+}
+
+// decode the header and the records into absolute times and values
+void decode() {
+	size_t pos = 2;
+
+	if (dump.size() < 13 || dump[0] != 'T' || dump[1] != 'R') {
+		throw "not a trace dump";
+	}
+	unsigned long time = readLittleEndian(pos, 4);
+	long humidity = (int16_t)readLittleEndian(pos, 2);
+	long temperature = (int16_t)readLittleEndian(pos, 2);
+	dumpSettingsCount = dump[pos++];
+	if (dumpSettingsCount > sizeof(dumpSettings) || pos + dumpSettingsCount + 2 > dump.size()) {
+		throw "bad settings in the header";
+	}
+	for (byte i = 0; i < dumpSettingsCount; i++) {
+		dumpSettings[i] = dump[pos++];
+	}
+	size_t length = readLittleEndian(pos, 2);
+	if (pos + length != dump.size()) {
+		throw "the length does not match the dump";
+	}
+
+	while (pos < dump.size()) {
+		Record r = Record();
+		byte header = dump[pos++];
+
+		r.event = header & 0x0F;
+		r.arg = header >> 4;
+		if (r.event != traceEventDht) {
+			time += readVarint(pos);
+		}
+		r.time = time;      // a DHT record has the time of the record before it
+
+		switch (r.event) {
+			case traceEventDht:
+				if (r.arg == 0) {
+					humidity += traceUnzigzag(readVarint(pos));
+					temperature += traceUnzigzag(readVarint(pos));
+				}
+				else if (r.arg >= 3) {
+					humidity += r.arg - 9;
+					r.arg = 0;
+				}
+				r.a = humidity;
+				r.b = temperature;
+				if (r.arg == 2) {
+					// the same reading repeated: one record for each reading the sketch takes
+					r.arg = 0;
+					for (unsigned long n = readVarint(pos); n > 1; n--) {
+						records.push_back(r);
+					}
+				}
+				break;
+			case traceEventButton:
+			case traceEventAmbient:
+				r.a = traceUnzigzag(readVarint(pos));
+				break;
+			case traceEventSetting:
+				r.a = readVarint(pos);
+				r.b = readVarint(pos);
+				r.previous = readVarint(pos);
+				if (r.a >= settingsCount) {
+					throw "a setting this sketch does not have";
+				}
+				break;
+			case traceEventPir:
+			case traceEventOutput:
+			case traceEventStatus:
+				break;
+			case traceEventState: {
+				size_t end = pos + 1 + dump[pos];
+				pos++;
+				while (pos < end) {
+					r.state.push_back(readVarint(pos));
+				}
+				if (pos != end) {
+					throw "a checkpoint is longer than its length";
+				}
+				break;
+			}
+			default:
+				throw "unknown event";
+		}
+		records.push_back(r);
+	}
+}
+
+// the DHT answers with the next recorded reading
+void dhtFromTrace() {
+	while (nextDht < records.size() && records[nextDht].event != traceEventDht) {
+		nextDht++;
+	}
+	if (nextDht >= records.size()) {
+		simDhtFail = true;
+		return;
+	}
+	const Record &r = records[nextDht++];
+	simDhtFail = r.arg != 0;
+	simHumidity = r.a / 10.0;
+	simTemperature = r.b / 10.0;
+}
+
+// put the sketch into the state of the checkpoint, with the settings it had then
+void restore(const Record &checkpoint, const byte* settingsThen) {
+	const std::vector<unsigned long> &s = checkpoint.state;
+	size_t i = 0;
+	unsigned long now = millis();
+
+	if (s.size() < 14) {
+		throw "the checkpoint is too short";
+	}
+	memcpy(eepromSettings, settingsThen, settingsCount);
+	unsigned long flags = s[i++];
+	byte menu = s[i++];
+	storedSettings = s[i++];
+	fanWorkingTimeAllowed = s[i++];
+	fanBudgetTime = now;
+	fanStopTime = now - s[i++];
+	lockStart = now - s[i++];
+	forceStart = now - s[i++];
+	lowInTime = now - s[i++];
+	buttonPressTime = now - s[i++];
+	fanButtonPressTime = now - s[i++];
+	nextDhtReading = now + traceUnzigzag(s[i++]);
+	counter = s[i++];
+	firstDecisionTime = s[i++];
+	byte ambient = s[i++];
+
+	if (i + 4 > s.size()) {
+		throw "the checkpoint is too short";
+	}
+	riseCount = s[i++];
+	riseNext = s[i++];
+	riseReadings = s[i++];
+	riseAccumulator = traceUnzigzag(s[i++]);
+	if (riseCount > riseWindow || i + riseCount != s.size()) {
+		throw "bad rise samples in the checkpoint";
+	}
+	int previous = 0;
+	riseSumY = 0;
+	riseSumXY = 0;
+	for (byte n = 0; n < riseCount; n++) {
+		riseSamples[n] = previous + traceUnzigzag(s[i++]);
+		previous = riseSamples[n];
+
+		// index 0 is the oldest sample
+		byte age = (riseCount < riseWindow) ? n : (n + riseWindow - riseNext) % riseWindow;
+		riseSumY += riseSamples[n];
+		riseSumXY += (long)age * riseSamples[n];
+	}
+
+	lockFan = flags & 1;
+	fanProtect = flags & 2;
+	fanForced = (flags >> 2) & 3;
+	light = flags & 16;
+	fanRunning = flags & 32;
+	lowLock = flags & 64;
+	ambientDark = flags & 128;
+	sensorFailed = flags & 256;
+	readPirSensor = flags & 512;
+	digitalWrite(relayFan, (flags >> 10) & 1);
+	digitalWrite(ledPin, (flags >> 11) & 1);
+	analogWrite(bri, light ? eepromSettings[0] : 0);
+	simSetInput(pirPin, (flags >> 12) & 1);
+	previousButtonStateFan = (flags >> 13) & 1;
+	previousButtonState = (flags >> 14) & 1;
+	previousButtonStateSettings = (flags >> 15) & 1;
+	previousButtonStateAdjustUp = (flags >> 16) & 1;
+	previousButtonStateAdjustDown = (flags >> 17) & 1;
+	riseReleased = (flags >> 18) & 1;
+	simSetInput(buttonFan, previousButtonStateFan);
+	simSetInput(buttonLight, previousButtonState);
+	simSetInput(buttonSettings, previousButtonStateSettings);
+	simSetInput(buttonUp, previousButtonStateAdjustUp);
+	simSetInput(buttonDown, previousButtonStateAdjustDown);
+
+	modeSettings = menu != 0;
+	currentSetting = menu ? settings[menu - 1] : "";
+
+	// the light sensor keeps reading the level of the checkpoint
+	simAmbientAdc = ambient << 2;
+	ambientAverage = ambient << 2;
+
+	dashboardReady = firstDecisionTime != 0;
+	traceSinceCheckpoint = 0;
+}
+
+// the changes of the unit should come out of the replay in the same order and at about the same time
+bool compare(const std::vector<Change> &unit, const std::vector<Change> &replay, unsigned long end, unsigned long &skew, bool verbose) {
+	const char kinds[] = "FLSW";
+	bool same = true;
+
+	// each kind of change is matched on its own
+	for (byte k = 0; k < 4; k++) {
+		size_t j = 0;
+
+		for (size_t i = 0; i < unit.size(); i++) {
+			const Change &u = unit[i];
+			if (u.what != kinds[k]) {
+				continue;
+			}
+			while (j < replay.size() && replay[j].what != u.what) {
+				j++;
+			}
+			if (j >= replay.size()) {
+				printf("  %9.3f s %c %d: the replay did not do it\n", u.time / 1000.0, u.what, u.value);
+				same = false;
+				continue;
+			}
+			const Change &r = replay[j++];
+			unsigned long difference = (r.time > u.time) ? r.time - u.time : u.time - r.time;
+			skew = max(skew, difference);
+			if (r.value != u.value || difference > replayTolerance) {
+				printf("  %9.3f s %c %d: the replay did %c %d at %.3f s\n", u.time / 1000.0, u.what, u.value, r.what, r.value, r.time / 1000.0);
+				same = false;
+			}
+			else if (verbose) {
+				printf("  %9.3f s %c %d ok (%ld ms)\n", u.time / 1000.0, u.what, u.value, (long)r.time - (long)u.time);
+			}
+		}
+
+		// the replay runs a bit past the dump; what it did before the end should have been recorded
+		for (; j < replay.size(); j++) {
+			if (replay[j].what == kinds[k] && replay[j].time + replayTolerance <= end) {
+				printf("  %9.3f s %c %d: the unit did not do it\n", replay[j].time / 1000.0, replay[j].what, replay[j].value);
+				same = false;
+			}
+		}
+	}
+	return same;
+}
+
+// the unit showed "Fan is ON", "Fan is resting" and "Fan is OFF" in this order
+bool restedFan(const std::vector<Change> &unit) {
+	const int sequence[] = {1, 2, 3};
+	byte n = 0;
+
+	for (const Change &c : unit) {
+		if (c.what == 'S' && n < 3 && c.value == sequence[n]) {
+			n++;
+		}
+	}
+	return n == 3;
+}
+
+int main(int argc, char** argv) {
+	bool verbose = false;
+	bool rest = false;
+	unsigned long window = 0;
+
+	for (int i = 2; i < argc; i++) {
+		if (strcmp(argv[i], "-v") == 0) {
+			verbose = true;
+		}
+		else if (strcmp(argv[i], "-r") == 0) {
+			rest = true;
+		}
+		else if (strcmp(argv[i], "-w") == 0 && i + 1 < argc) {
+			window = strtoul(argv[++i], 0, 10) * 1000;
+		}
+		else {
+			argc = 0;
+		}
+	}
+	if (argc < 2) {
+		printf("usage: trace_replay <dump file> [-v] [-w <seconds>] [-r]\n");
+		return 2;
+	}
+	if (!readDump(argv[1])) {
+		return 2;
+	}
+
+	size_t start = 0;
+	try {
+		decode();
+		while (start < records.size() && records[start].event != traceEventState) {
+			start++;
+		}
+		if (start == records.size()) {
+			throw "there is no checkpoint in the dump";
+		}
+		if (dumpSettingsCount != settingsCount) {
+			throw "the dump has other settings than this sketch";
+		}
+	}
+	catch (const char* error) {
+		printf("trace_replay: %s\n", error);
+		return 2;
+	}
+	const Record &checkpoint = records[start];
+	unsigned long end = records.back().time;
+
+	// the settings then: the ones at the end of the dump with the writes since the checkpoint undone
+	byte settingsThen[settingsCount];
+	memcpy(settingsThen, dumpSettings, settingsCount);
+	for (size_t i = records.size(); i-- > start + 1;) {
+		if (records[i].event == traceEventSetting) {
+			settingsThen[records[i].a] = records[i].previous;
+		}
+	}
+
+	// what the unit did after the checkpoint
+	std::vector<Change> unit;
+	unsigned long flags = checkpoint.state[0];
+	int fan = (flags >> 10) & 1;
+	int lamp = (flags >> 11) & 1;
+	int status = (flags >> 19) & 7;
+	int initialStatus = status;
+	byte unitSettings[settingsCount];
+	for (byte i = 0; i < settingsCount; i++) {
+		unitSettings[i] = settingsThen[i];
+	}
+	for (size_t i = start + 1; i < records.size(); i++) {
+		const Record &r = records[i];
+		if (r.event == traceEventSetting) {
+			// the Modbus writes are fed to the replay, the menu ones should come out of it
+			if (r.arg == 0 && unitSettings[r.a] != r.b) {
+				unit.push_back({r.time, 'W', (int)(r.a << 8 | r.b)});
+			}
+			unitSettings[r.a] = r.b;
+		}
+		else if (r.event == traceEventOutput) {
+			if ((r.arg & 1) != fan) {
+				fan = r.arg & 1;
+				unit.push_back({r.time, 'F', fan});
+			}
+			if (((r.arg >> 1) & 1) != lamp) {
+				lamp = (r.arg >> 1) & 1;
+				unit.push_back({r.time, 'L', lamp});
+			}
+		}
+		else if (r.event == traceEventStatus && r.arg != status) {
+			// the replay only sees the status line after each loop()
+			size_t later = i + 1;
+			while (later < records.size() && records[later].event != traceEventStatus) {
+				later++;
+			}
+			if (later < records.size() && records[later].time - r.time < replayBurst) {
+				continue;
+			}
+			status = r.arg;
+			unit.push_back({r.time, 'S', status});
+		}
+	}
+
+	// boot the sketch with the settings of the checkpoint, then jump to it
+	for (byte i = 0; i < settingsCount; i++) {
+		simEeprom[i] = settingsThen[i];
+	}
+	simEeprom[settingsCountAddress] = dumpSettingsCount;
+	nextDht = start + 1;
+	simSensorHook = dhtFromTrace;
+	setup();
+	if (simMicros < checkpoint.time * 1000) {
+		simAdvance(checkpoint.time * 1000 - simMicros);
+	}
+	try {
+		restore(checkpoint, settingsThen);
+	}
+	catch (const char* error) {
+		printf("trace_replay: %s\n", error);
+		return 2;
+	}
+	statusLine = initialStatus;
+
+	// run the sketch with the recorded inputs
+	std::vector<Change> replay;
+	fan = simOutput(relayFan);
+	lamp = simOutput(ledPin);
+	status = statusLine;
+	byte settingsSeen[settingsCount];
+	memcpy(settingsSeen, eepromSettings, settingsCount);
+	size_t next = start + 1;
+	while (millis() <= end + replayTolerance) {
+		unsigned long now = millis();
+
+		for (; next < records.size() && records[next].time <= now + replayPirLead; next++) {
+			const Record &r = records[next];
+			if (r.event == traceEventPir) {
+				simSetInput(pirPin, r.arg);
+			}
+			else if (r.event == traceEventAmbient) {
+				simAmbientAdc = r.a << 2;
+			}
+			else if (r.time > now) {
+				break;      // only the PIR and the ambient light go ahead
+			}
+			else if (r.event == traceEventButton) {
+				simSetInput(r.a, r.arg);
+			}
+			else if (r.event == traceEventSetting && r.arg == 1) {
+				eepromSettings[r.a] = r.b;
+				settingsSeen[r.a] = r.b;
+				if (r.a == 0 && light) {
+					analogWrite(bri, r.b);
+				}
+				else if (r.a == 1) {
+					analogWrite(contrast, r.b);
+				}
+			}
+		}
+
+		loop();
+
+		if (simOutput(relayFan) != fan) {
+			fan = simOutput(relayFan);
+			replay.push_back({millis(), 'F', fan});
+		}
+		if (simOutput(ledPin) != lamp) {
+			lamp = simOutput(ledPin);
+			replay.push_back({millis(), 'L', lamp});
+		}
+		if (statusLine != status) {
+			status = statusLine;
+			replay.push_back({millis(), 'S', status});
+		}
+		for (byte i = 0; i < settingsCount; i++) {
+			if (eepromSettings[i] != settingsSeen[i]) {
+				settingsSeen[i] = eepromSettings[i];
+				replay.push_back({millis(), 'W', i << 8 | eepromSettings[i]});
+			}
+		}
+	}
+
+	unsigned long skew = 0;
+	bool same = compare(unit, replay, end, skew, verbose);
+	if (end - checkpoint.time < window) {
+		printf("  the replay takes %.1f s, shorter than %lu s\n", (end - checkpoint.time) / 1000.0, window / 1000);
+		same = false;
+	}
+	if (rest && !restedFan(unit)) {
+		printf("  the unit did not show the fan ON, resting and OFF in the replayed part\n");
+		same = false;
+	}
+
+	printf("trace_replay: %.1f s replayed from the checkpoint at %.3f s, %u changes, largest time difference %lu ms: %s\n",
+		(end - checkpoint.time) / 1000.0, checkpoint.time / 1000.0, (unsigned int)unit.size(), skew, same ? "same" : "DIFFERENT");
+	return same ? 0 : 1;
+}
@@ -22,6 +22,14 @@
  * DHT - to ground
 
  
+ SHT3x connections (instead of DHT, when SENSOR_TYPE is SENSOR_SHT3X)
+ * SHT3x VDD to 5V (use a module with a voltage regulator and level shifter)
+ * SHT3x GND to ground
+ * SHT3x SDA to analog pin A4 and SCL to analog pin A5 (the module has the pull-up resistors)
+ * SHT3x ADDR to ground (address 0x44)
+ * the fan and the light buttons move to digital pins D12 and D13
+
+ 
  Button connections
  * one side of each button connect to the ground through resistor 50 k Ohm (yellow, purple, orange, gold) and then:
  *  - The fan button to analog pin A5 (ground - resistor - button - pin A5)
@@ -36,8 +44,25 @@
  * VCC to 5V
  * GND to ground
  * OUT to analog pin A0
+
+
+ Ambient light sensor (optional)
+ * LDR (or phototransistor) from 5V to analog pin A6, resistor 10 k Ohm from A6 to ground
+ * A6 is on the TQFP/QFN atmega328P only (Arduino Nano, Pro Mini); the DIP package has no spare analog pin
+ * the "Dark level" setting at 0 turns the sensor OFF (the PIR sensor alone controls the light)
  
  
+ RS-485 transceiver (MAX485) when MODBUS_ENABLED is 1
+ * RO to digital pin D0 (RX), DI to digital pin D1 (TX)
+ * DE and RE together to digital pin D13 (with SHT3x tie them to an auto-direction module, there is no spare pin)
+ * the DHT out moves to digital pin D12 and the RELAY IN1 to digital pin D6
+
+ 
+ Trace dump over serial when TRACE_SERIAL is 1
+ * a USB-serial adapter RX to digital pin D1 (TX), 57600 baud
+ * the DHT out and the RELAY IN1 move the same way as with Modbus (D12 and D6)
+
+ 
  Relay Module (2-channel) using external power supply
  * RELAY JD-VCC (remove the jumper) and connect to the other source 5V
  * RELAY VCC leave unconected
@@ -53,20 +78,63 @@
  * connect the external cristal to XLAT1 and XLAT2 pins of atmega328P
 */
 
+// build options; the host build (host/CMakeLists.txt) sets them with -D to test every variant
+
+// humidity sensor
+#define SENSOR_DHT22 1    // DHT22 on a single wire, read every 5 seconds
+#define SENSOR_SHT3X 2    // SHT3x on I2C, read every second
+#ifndef SENSOR_TYPE
+#define SENSOR_TYPE SENSOR_DHT22  // which humidity sensor is connected
+#endif
+
+// serial register-map protocol
+#ifndef MODBUS_ENABLED
+#define MODBUS_ENABLED 0  // 1 -> Modbus RTU slave on the hardware UART (D0 and D1 are taken from the DHT and the fan relay)
+#endif
+
+// trace recorder
+#ifndef TRACE_ENABLED
+#define TRACE_ENABLED 1   // 1 -> record the trace; 0 -> the recorder is not compiled in
+#endif
+#ifndef TRACE_SERIAL
+#define TRACE_SERIAL 0    // 1 -> hold the UP button and press settings to dump the trace over serial (D0 and D1 as with Modbus)
+#endif
+
+// fan run budget
+#ifndef FAN_REFILL_RATE
+#define FAN_REFILL_RATE 100   // % of the time the fan is OFF given back to the run budget (1 - 100)
+#endif
+
 // include libraries:
 #include <LiquidCrystal.h> // The LiquidCrystal library works with all LCD displays that are compatible with the Hitachi HD44780 driver.
+#if SENSOR_TYPE == SENSOR_DHT22
 #include "DHT.h"
+#endif
 #include <EEPROM.h>
 #include<string.h>
+#include <util/crc16.h>
 
 // define atmega328 pins
+#if MODBUS_ENABLED || TRACE_SERIAL
+#define relayFan 6        // which pin is controlling the relay (D1 is UART TX)
+#else
 #define relayFan 1        // which pin is controlling the relay
+#endif
+#if SENSOR_TYPE == SENSOR_SHT3X
+#define buttonFan 12      // pin to turn the fan ON             (A5 is I2C SCL)
+#define buttonLight 13    // button turning the light ON or OFF (A4 is I2C SDA)
+#else
 #define buttonFan 19      // pin to turn the fan ON             (Analog in A5)
 #define buttonLight 18    // button turning the light ON or OFF (Analog in A4)
+#endif
 #define buttonSettings 17 // pin to settings                    (Analog in A3)
 #define buttonUp 16       // pin to navigate UP                 (Analog in A2)
 #define buttonDown 15     // pin to navigate Down               (Analog in A1)
+#if MODBUS_ENABLED || TRACE_SERIAL
+#define DHTPIN 12         // what digital pin we're connected to (D0 is UART RX)
+#else
 #define DHTPIN 0          // what digital pin we're connected to
+#endif
 #define contrast 11       // pin controlling the lcd screen contrast 
 #define bri 5             // pin controlling the lcd screen brightness
 #define DHTTYPE DHT22     // DHT 22  (AM2302), AM2321
@@ -74,9 +142,37 @@
 
 
 
+/* --------------- HUMIDITY SENSOR ----------------------------------------- */
+// getDhtSensorData() talks to the sensor only through sensorBegin(), sensorStart() and sensorRead(),
+// so each sensor is a backend selected by SENSOR_TYPE.
+#define sensorBusy 0      // the conversion is still running
+#define sensorReady 1     // new humidity and temperature
+#define sensorFail 2      // no answer or a broken reading
+bool sensorConverting = false;	// a conversion has been started and not read yet
+
+#if SENSOR_TYPE == SENSOR_DHT22
 // Initialize DHT sensor.
 DHT dht(DHTPIN, DHTTYPE); 
 
+#elif SENSOR_TYPE == SENSOR_SHT3X
+#define shtAddress 0x44       // ADDR pin to ground
+#define shtMeasureTime 16     // millisecs of single shot conversion with high repeatability
+#define twiIdle 0
+#define twiBusy 1
+#define twiError 2
+volatile byte twiState = twiIdle;	// state of the current I2C transfer
+volatile byte twiCount;				// bytes transferred so far
+byte twiLength;						// bytes to transfer
+byte twiAddress;					// slave address with the read/write bit
+byte twiBuffer[6];					// command to send or data received
+bool shtReading = false;			// false -> the measure command was sent; true -> the result is being read
+unsigned long shtStartTime;			// when the measure command was sent
+
+#else
+#error "Unknown SENSOR_TYPE"
+#endif
+/* --------------- EOF: HUMIDITY SENSOR ------------------------------------ */
+
 // initialize the library by associating any needed LCD interface pin
 // with the arduino pin number it is connected to
 const int rs = 10, en = 9, d4 = 7, d5 = 4, d6 = 3, d7 = 2;
@@ -89,18 +185,34 @@ byte minContrast = 0;
 
 byte fanForced = 0;							// mode 0-> normal; 1->fan forced to run; 2->fan forced to stop.
 long fanStopTime = 0;						// the time when the fan was turned OFF
-long fanWorkingTimeAllowed;					// the maximum time for the fan to run
+long fanWorkingTimeAllowed;					// the fan run budget in millisecs (token bucket, see fanBudget())
+unsigned long fanBudgetTime = 0;			// when the fan run budget was brought up to date
+bool fanRunning = false;					// the fan relay is ON and the budget drains
+const byte fanRefillRate = FAN_REFILL_RATE;	// % of the time the fan is OFF given back to the run budget
+byte fanRefillCarry = 0;					// hundredths of a millisec refilled and not in the budget yet
 bool light = false;                        	// light is OFF (false) or ON (true)
 bool lockFan = false;                      	// lock the fan (prevent turning on and off many times)
 long lockStart = 0;                         // counter for the fan lock
 long fanSaveTime = 0;						// when the fan was turned off in order to cool
-long forceTimer = 0;						// count the time of fan forced to run
+unsigned long forceStart = 0;				// when the fan was forced to run
 unsigned int counter = 0;                  	// main loop counter
 bool modeDHT = true;                       	// default mode
 bool modeSettings = false;                 	// if we are in setting mode or not
 bool fanProtect = false;					// fan protection prevents from running the fan for too long.
-String currentSetting = "";                	// what setting we are in at the moment.
+const char* currentSetting = "";           	// what setting we are in at the moment (one of settings[], compared by address).
+#if SENSOR_TYPE == SENSOR_SHT3X
+const unsigned int dhtDataInterval = 1000; 	// number of millisecs between reading DHT data
+const unsigned int dhtFirstReading = 2; 	// SHT3x is ready 1.5 millisec after power-up
+const unsigned int dhtRetryInterval = 100;	// try again quickly after a failed reading
+#else
 const unsigned int dhtDataInterval = 5000; 	// number of millisecs between reading DHT data
+const unsigned int dhtFirstReading = 1000; 	// DHT22 needs 1 second after power-up before the first reading
+const unsigned int dhtRetryInterval = 2000;	// DHT22 can not be read more often than every 2 seconds
+#endif
+unsigned long nextDhtReading = dhtFirstReading;	// when to read DHT data next time
+unsigned long firstDecisionTime = 0;		// millisecs from power-on to the first fan decision (0 -> not yet)
+int lastHumidity = 0;						// the latest valid humidity reading in tenths of %
+int lastTemperature = 0;					// the latest valid temperature reading in tenths of Celsius
 byte previousButtonState = LOW;            	// the previous button state as a default has to be LOW because of the pull-down resistor
 byte previousButtonStateFan = LOW;
 byte previousButtonStateSettings = LOW;    	// the previous button state as a default has to be LOW because of the pull-down resistor
@@ -114,26 +226,309 @@ unsigned long lastPirSensorRead;			// the time of pir sensor reading
 
 // an array of settings names
 char* settings[]={
-	"Brightness", "Contrast", "Humidity", "Default light", "Fan lock", "Fan max run time", "Fan time to rest", "Light lock"
+	"Brightness", "Contrast", "Humidity", "Default light", "Fan lock", "Fan max run time", "Fan time to rest", "Light lock", "Rise trigger", "Dark level"
 };
 
+#define settingsCount (sizeof(settings) / sizeof(settings[0]))
+
 // An array of settings saved in eeprom.
-unsigned int eepromSettings[sizeof(settings)];
+byte eepromSettings[settingsCount];
+
+// default settings written to the empty EEPROM
+const byte defaultSettings[] = {
+	7,		// brightness
+	90,		// contrast
+	37,		// Humidity
+	true,	// lcd light
+	1,		// time to lock the fan
+	2,		// fan max running time
+	1,		// fan time to cool down
+	5,		// time to lock the light
+	3,		// humidity rise (% per minute) starting the fan early; 0 -> OFF
+	0		// ambient light (0 - 255) below which a motion turns the light ON; 0 -> OFF
+};
+unsigned int eepromDirty = 0;				// one bit per settings address waiting to be written to EEPROM
+
+// Every value of a setting is valid (the menu reaches 255 too), so the EEPROM keeps how many settings
+// have been written instead of 255 meaning "never written". A firmware adding a setting sees the count
+// lower than settingsCount and writes the default of the new setting.
+#define settingsCountAddress 63				// EEPROM address of the count (255 -> not stored yet)
+#define settingsLegacyCount 8				// settings written by the firmware before the count was stored
+bool settingsCountDirty = false;			// the count waits to be written (after the settings)
 
 
 /* --------------- PIR SENSOR -------------------------------------------- */   
 #define pirPin 14     		//PIR out (Analog in A0)
 int ledPin = 8;          	//the led light pin (the light is ON or OFF)
+const unsigned long pirCalibrationTime = 30000;	// the sensor calibrates itself after power-up
 boolean lowLock = false;
 long unsigned lowInTime; //the time when the sensor outputs a low impulse
 bool readPirSensor = false;
 /* --------------- EOF: PIR SENSOR ------------------------------------------*/
 
 
+/* --------------- AMBIENT LIGHT ------------------------------------------- */
+// The ADC converts the light sensor on every Timer0 overflow (about 1 kHz) without the loop asking for it;
+// the ADC interrupt sums the conversions and publishes the average of every ambientSamples.
+// The loop never waits for a conversion like analogRead() does.
+#define ambientChannel 6                // ADC6 (pin A6)
+#define ambientSamples 64               // conversions averaged into one level (64 * 1023 fits in 16 bits)
+const byte ambientHysteresis = 8;       // how much brighter than "Dark level" it has to be to count as bright again
+volatile unsigned int ambientSum = 0;   // sum of the conversions so far
+volatile byte ambientCount = 0;         // number of them
+volatile unsigned int ambientAverage = 0;	// the last average (0 - 1023)
+bool ambientDark = true;                // dark enough to turn the light ON
+/* --------------- EOF: AMBIENT LIGHT -------------------------------------- */
+
+
+/* --------------- HUMIDITY RISE --------------------------------------------- */
+// A shower raises the humidity fast. The slope of the humidity is fitted with least squares
+// over the last minute, so the fan can start before the humidity crosses the limit
+// and stop a bit earlier once the humidity is falling back to it.
+#define riseWindow 12                   // samples in the fit
+const unsigned int riseSampleTime = 5000; 	// millisecs per sample; faster readings are averaged
+const byte riseNearBand = 3;            // % around the humidity limit where a fast rise starts and a falling humidity stops the fan
+int riseSamples[riseWindow];            // humidity samples in tenths of %, ring buffer
+byte riseNext = 0;                      // where the next sample goes (the oldest sample when the window is full)
+byte riseCount = 0;                     // samples in the window
+long riseSumY = 0;                      // sum of the samples
+long riseSumXY = 0;                     // sum of sample * its index (0 is the oldest)
+long riseAccumulator = 0;               // readings waiting to be averaged into one sample
+byte riseReadings = 0;                  // number of them
+bool riseReleased = false;              // the lock was released early; it is not set again by the humidity above the limit
+                                        // until the humidity is down to the limit or rising again
+/* --------------- EOF: HUMIDITY RISE -------------------------------------- */
+
+
+/* --------------- SNAPSHOT ------------------------------------------------- */
+// The fan protection state survives a reset (brown-out, relay spikes): it is saved to EEPROM
+// in one of two slots in turn, so a write torn by a power cut leaves the other slot valid.
+// The atmega328 has no brown-out interrupt (BOD only resets the chip), so the snapshot is taken
+// whenever the state changes and every snapshotInterval - more often while the fan runs or rests,
+// because then the timers matter, and not at all while nothing changes in the idle state
+// or while the fan has rested long enough and only waits for the light.
+// EEPROM cells take about 100 000 writes.
+//
+// Snapshot (11 bytes):
+//  0 sequence (the newer slot wins)
+//  1 flags: bit 0 lockFan, bit 1 fanProtect, bit 2 light, bit 3 fan relay, bits 4-5 fanForced
+//  2 fanWorkingTimeAllowed (secs)
+//  4 secs since fanStopTime
+//  6 secs since lockStart
+//  8 secs since forceStart
+// 10 CRC-8 of bytes 0 - 9
+#define snapshotAddress 64                  // EEPROM address of the first slot; the second one follows
+#define snapshotSlotSize 16
+#define snapshotSize 11
+const unsigned long snapshotInterval = 600000;  // millisecs between snapshots when nothing changes
+const unsigned long snapshotActiveInterval = 60000; // the same while the fan runs, rests or is forced
+byte snapshotBuffer[snapshotSize];          // the snapshot being written
+byte snapshotPending = 0;                   // bytes of it still to be written
+byte snapshotSlot = 0;                      // the slot the next snapshot goes to
+byte snapshotSequence = 0;                  // sequence number of the last snapshot
+byte snapshotFlags = 0xFF;                  // flags of the last snapshot
+unsigned long snapshotTime = 0;             // when the last snapshot was taken
+bool snapshotIdle = false;                  // the last snapshot was taken while the controller was idle
+/* --------------- EOF: SNAPSHOT ------------------------------------------- */
+
+
+/* --------------- DASHBOARD ------------------------------------------------ */
+// Pages rotate on the display: the readings, a humidity sparkline, the fan budget, the light lock and the memory.
+// A page is drawn into lcdFrame and only the cells differing from lcdShadow (what the display shows)
+// are sent to the display. The sparkline is drawn with the 8 custom characters of the HD44780 (CGRAM)
+// and only the glyph rows which have changed are rewritten.
+#define dashboardPages 5
+#define sparkColumns 40                     // 8 glyphs, 5 pixel columns each
+const unsigned int dashboardPageTime = 4000;	// millisecs per page
+const unsigned int dashboardRefresh = 1000;	// millisecs between redraws of the countdowns
+const unsigned long sparkSampleTime = 30000;	// millisecs per sparkline column (20 minutes of history)
+char lcdFrame[2][16];                       // the page being drawn
+char lcdShadow[2][16];                      // what the display shows
+bool lcdShadowValid = false;                // false -> something else (the settings, the splash) wrote the display
+byte sparkGlyphs[8][8];                     // what the CGRAM holds (5 bits per row)
+bool sparkGlyphsValid = false;              // false -> the CGRAM content is unknown
+byte sparkHistory[sparkColumns];            // humidity % ring buffer, one value per sparkSampleTime
+byte sparkNext = 0;                         // where the next value goes
+byte sparkCount = 0;                        // values in the history
+unsigned long sparkTime = 0;                // when the last value was added
+byte dashboardPage = 0;                     // the page shown
+bool dashboardReady = false;                // the first reading has been done (the splash screen is shown until then)
+bool dashboardHeld = false;                 // "Saving settings..." is shown until the next page
+unsigned long dashboardPageStart = 0;       // when the page was shown
+unsigned long dashboardDrawTime = 0;        // when the page was drawn
+byte statusLine = 0;                        // the fan state or the light message on the first page (one of statusMessages[])
+// the messages of the status line; the trace records the index
+const char* const statusMessages[] = {
+	"", "Fan is ON       ", "Fan is resting  ", "Fan is OFF  ", "Fan is OFF ???  ", "Fan forced ON   ", "Fan forced OFF  ", "Light is OFF    "
+};
+#define statusFanOn 1
+#define statusFanResting 2
+#define statusFanOff 3
+#define statusFanUnknown 4
+#define statusFanForcedOn 5
+#define statusFanForcedOff 6
+#define statusLightOff 7
+unsigned long lcdWrites = 0;                // bytes sent to the display (commands and data)
+/* --------------- EOF: DASHBOARD ------------------------------------------ */
+
+
+/* --------------- TRACE RECORDER ------------------------------------------- */
+// Every input the controller sees (DHT readings, button and PIR edges, the ambient light turning dark
+// or bright, the settings written) and every change of the relays is logged into a RAM ring buffer.
+// When a unit misbehaves in the field the trace can be dumped over serial and replayed on a PC
+// through the same loop() logic (host/trace_replay).
+//
+// Record layout:
+//  - header byte: low nibble is the event, high nibble is the event argument
+//  - milliseconds since the previous record as a varint (7 bits per byte, MSB = more bytes follow);
+//    not in the DHT records: the replay feeds the readings in order, whenever the sketch reads the sensor
+//  - event payload as zigzag encoded varints
+//
+// The inputs alone do not tell the state the oldest record found the controller in (the lock, the
+// fan budget, the timers), so a state record (checkpoint) is written at the start of loop() after
+// every traceCheckpointSpacing bytes of other records. The replay starts from the oldest checkpoint
+// left in the ring buffer, so the checkpoint is kept small: the settings are not in it (the dump has
+// the settings at its end and each setting record has the value it replaced). Its payload (unsigned
+// varints unless said otherwise):
+//  - payload length in bytes (one byte)
+//  - flags: see traceStateFlags()
+//  - settings menu: 0 -> closed, otherwise the setting shown + 1; then storedSettings
+//  - fanWorkingTimeAllowed
+//  - millisecs since fanStopTime, lockStart, forceStart and lowInTime
+//  - millisecs since buttonPressTime and fanButtonPressTime, at most traceButtonAgeLimit
+//  - nextDhtReading - now (zigzag), counter, firstDecisionTime, ambient light level
+//  - riseCount, riseNext, riseReadings, riseAccumulator (zigzag)
+//    and the riseCount samples, each as the change against the previous one (zigzag)
+#define traceEventDht 1       // payload: humidity and temperature change in tenths; argument 1 -> sensor fail (no payload),
+                              // argument 2 -> the same reading again, payload: how many times (unsigned, 1 - 127),
+                              // argument 3 - 15 -> only the humidity changed, by argument - 9 tenths (no payload)
+#define traceEventButton 2    // payload: button pin; argument: button state
+#define traceEventPir 3       // argument: PIR output
+#define traceEventOutput 4    // argument: bit 0 -> fan relay pin, bit 1 -> light relay pin
+#define traceEventState 5     // payload: the state checkpoint above
+#define traceEventStatus 6    // argument: the status line shown (index of statusMessages[])
+#define traceEventAmbient 7   // payload: ambient light level; argument: ambientDark (recorded when it changes)
+#define traceEventSetting 8   // payload: setting address, its new value and the value it replaced (unsigned); argument: 0 -> settings menu, 1 -> Modbus
+#define traceCheckpointSpacing 96   // bytes of records between two checkpoints (a checkpoint takes 35 - 55 bytes)
+#define traceAgeLimit 0x0FFFFFFFUL  // longer ages are recorded as this (4 varint bytes; 74 hours)
+#define traceButtonAgeLimit 0x3FFFUL    // the button timers only matter for 500 millisecs (2 varint bytes)
+
+#if TRACE_ENABLED
+byte traceBuffer[256];                  // ring buffer; byte indexes wrap around by themselves
+byte traceHead = 0;                     // where the next byte will be written
+byte traceTail = 0;                     // where the oldest record starts
+unsigned int traceUsed = 0;             // number of bytes in the ring buffer
+unsigned long traceBaseTime = 0;        // the time the oldest record's delta refers to
+int traceBaseHumidity = 0;              // humidity (tenths) the oldest DHT record's delta refers to
+int traceBaseTemperature = 0;           // temperature (tenths) the oldest DHT record's delta refers to
+unsigned long traceLastTime = 0;        // the time of the newest record
+int traceLastHumidity = 0;              // the newest humidity recorded
+int traceLastTemperature = 0;           // the newest temperature recorded
+byte traceLastPir = LOW;                // the last PIR output recorded
+byte traceLastOutput = 0xFF;            // the last relays state recorded (0xFF -> nothing recorded yet)
+byte traceLastStatus = 0xFF;            // the last status line recorded
+byte traceRepeats = 0;                  // how many times the newest record repeats the DHT reading (0 -> it is another record)
+byte traceRepeatsAt = 0;                // where its count is
+unsigned int traceSinceCheckpoint = traceCheckpointSpacing;	// bytes recorded since the last checkpoint (the first loop writes one)
+#endif
+/* --------------- EOF: TRACE RECORDER ------------------------------------- */
+
+
+/* --------------- MODBUS --------------------------------------------------- */
+// Modbus RTU slave, so one supervisor can poll many controllers on a shared RS-485 line.
+// The UART interrupts receive and send without Serial: each byte is timestamped when it arrives, so the
+// 3.5 characters of silence that end a frame are measured on the line and not by how often the loop runs,
+// and the TX complete interrupt turns the RS-485 driver off right after the stop bit of the last byte.
+// The loop only answers the request.
+//
+// Holding registers (functions 03, 06, 16): the settings, the same order as the settings menu.
+// Input registers (function 04):
+//  0 humidity (tenths of %)         1 temperature (tenths of Celsius)
+//  2 fan relay ON                   3 fanProtect
+//  4 fanWorkingTimeAllowed (secs)   5 lockFan
+//  6 light relay ON                 7 fanForced
+//  8 DHT sensor fail                9 ambient light (0 - 255)
+// 10 free memory (bytes)            11 the smallest free memory since boot
+// 12 heap size                      13 free blocks in the heap
+// 14 static variables               15 - 20 static RAM of the settings, display, sensor, control, trace and serial
+// 21 millisecs from power-on to the first fan decision (0 -> not yet, 65535 -> later)
+// Note: the DHT22 library disables interrupts for about 4 millisecs per reading, so a byte may be lost
+// now and then - the supervisor sees a CRC error and asks again. The SHT3x backend does not have that problem.
+#define modbusAddress 1       // slave address of this controller (1 - 247)
+#define modbusBaud 38400      // serial speed
+#if SENSOR_TYPE == SENSOR_SHT3X
+#define modbusDePin -1        // no spare pin; use an auto-direction RS-485 module
+#else
+#define modbusDePin 13        // RS-485 driver enable (DE and RE)
+#endif
+#define modbusInputRegisters 22
+
+#if MODBUS_ENABLED && TRACE_SERIAL
+#error "MODBUS_ENABLED and TRACE_SERIAL both need the UART"
+#endif
+
+#if MODBUS_ENABLED
+byte modbusFrame[64];                   // the request received and then the response sent
+volatile byte modbusLength = 0;         // bytes in modbusFrame
+volatile unsigned long modbusLastByte;  // micros of the last byte received (taken in the RX interrupt)
+volatile bool modbusFrameReady = false; // a request is waiting for the loop; the bytes received meanwhile are dropped
+volatile bool modbusSending = false;    // the response is being sent (the RS-485 driver is ON)
+volatile byte modbusSent;               // bytes of the response handed to the UART
+byte modbusResponseLength;              // bytes in the response
+const unsigned long modbusSilence = max(1750UL, 38500000UL / modbusBaud);	// 3.5 characters of silence ends a frame
+#endif
+bool sensorFailed = true;               // the latest DHT reading failed
+/* --------------- EOF: MODBUS --------------------------------------------- */
+
+
+/* --------------- MEMORY --------------------------------------------------- */
+// 2 KB of SRAM hold the static variables, the heap (String) growing up and the stack growing down.
+// If they meet, the controller resets at random. setup() paints the gap between them with memoryPaint;
+// the stack overwrites the paint as it grows, so the paint left is the smallest gap there has ever been.
+#define memoryPaint 0xC5
+const unsigned int memoryBudget = 1024;     // bytes the subsystems below may take together
+extern char __data_start;                   // the static variables begin here
+extern char __bss_end;                      // and end here
+extern char __heap_start;                   // the heap begins after the static variables
+extern char *__brkval;                      // the end of the heap (0 -> the heap has not been used yet)
+struct __freelist { size_t sz; struct __freelist *nx; };
+extern struct __freelist *__flp;            // the free blocks inside the heap
+
+// static RAM of each subsystem (the biggest variables)
+#define ramSettings (sizeof(eepromSettings) + sizeof(settings) + sizeof(defaultSettings))
+#define ramDisplay (sizeof(lcd) + sizeof(lcdFrame) + sizeof(lcdShadow) + sizeof(sparkGlyphs) + sizeof(sparkHistory))
+#if SENSOR_TYPE == SENSOR_SHT3X
+#define ramSensor (sizeof(twiBuffer))
+#else
+#define ramSensor (sizeof(dht))
+#endif
+#define ramControl (sizeof(riseSamples) + sizeof(snapshotBuffer))
+#if TRACE_ENABLED
+#define ramTrace (sizeof(traceBuffer))
+#else
+#define ramTrace 0
+#endif
+#if MODBUS_ENABLED
+#define ramSerial (sizeof(modbusFrame))
+#elif TRACE_SERIAL
+#define ramSerial (sizeof(Serial))
+#else
+#define ramSerial 0
+#endif
+#define ramSubsystems (ramSettings + ramDisplay + ramSensor + ramControl + ramTrace + ramSerial)
+
+// a new feature taking too much RAM fails the build instead of resetting units in the field
+static_assert(ramSubsystems <= memoryBudget, "the subsystems take more static RAM than memoryBudget");
+/* --------------- EOF: MEMORY --------------------------------------------- */
+
+
 void setup() {
+	// paint the free memory first, to measure the stack later
+	memoryPaintStack();
+
 	// set up the LCD's number of columns and rows:
 	lcd.begin(16, 2);
-	dht.begin();
+	sensorBegin();
 
 	// buttons
 	pinMode(buttonFan, INPUT);
@@ -147,21 +542,23 @@ void setup() {
 	digitalWrite(relayFan, HIGH);
 
 	// EEPROM
-	if (EEPROM.read(0) == 255) {
-		EEPROM.write(0, 7);		// brightness
-		EEPROM.write(1, 90);    // contrast
-		EEPROM.write(2, 37);    // Humidity
-		EEPROM.write(3, true);  // lcd light
-		EEPROM.write(4, 1);     // time to lock the fan		
-		EEPROM.write(5,2);		// fan max running time
-		EEPROM.write(6,1);		// fan time to cool down		
-		EEPROM.write(7, 5);		// time to lock the light
+	byte written = EEPROM.read(settingsCountAddress);
+	if (written == 255) {
+		// the EEPROM is empty or it was written before the count was stored
+		written = (EEPROM.read(0) == 255) ? 0 : settingsLegacyCount;
 	}
-
-	// populate the array of settings from EEPROM
-	for (int i = 0; i<sizeof(settings); i++){
-		eepromSettings[i] = EEPROM.read(i);
+	// populate the array of settings from EEPROM; the settings never written get the defaults right away
+	// and eepromService() writes them in the background - setup() does not wait for the EEPROM.
+	for (int i = 0; i<settingsCount; i++){
+		if (i < written) {
+			eepromSettings[i] = EEPROM.read(i);
+		}
+		else {
+			eepromSettings[i] = defaultSettings[i];
+			eepromDirty |= 1 << i;
+		}
 	}
+	settingsCountDirty = written != settingsCount;
 
 	// brightness settings
 	pinMode(bri, OUTPUT); //Set pin as OUTPUT
@@ -176,7 +573,8 @@ void setup() {
 	
 	
 	// fan variables
-	fanWorkingTimeAllowed = eepromSettings[5]*60000;  // in miliseconds
+	fanWorkingTimeAllowed = minutesToMillis(eepromSettings[5]);  // in miliseconds
+	fanBudgetTime = millis();
 
 	// contrast settings
 	pinMode(contrast, OUTPUT); //Set the pin as OUTPUT
@@ -187,14 +585,51 @@ void setup() {
 	digitalWrite(pirPin, HIGH);
 	pinMode(ledPin, OUTPUT);
 	digitalWrite(ledPin, HIGH);
+
+	// AMBIENT LIGHT
+	ambientBegin();
+
+	// the fan protection state from before the reset
+	snapshotRestore();
+
+	// splash screen with the cached settings; it stays until the first DHT reading (about 1 second)
+	lcd.print("Humidity ctrl");
+	lcd.setCursor(0,1);
+	lcd.print("H limit: "+(String)eepromSettings[2]+"%");
+
+	// TRACE
+#if TRACE_SERIAL
+	Serial.begin(57600);
+#endif
+
+	// MODBUS
+#if MODBUS_ENABLED
+	if (modbusDePin >= 0) {
+		pinMode(modbusDePin, OUTPUT);
+		digitalWrite(modbusDePin, LOW); // receive
+	}
+	UBRR0 = (F_CPU / 4 / modbusBaud - 1) / 2;     // double speed, the same rounding as Serial.begin()
+	UCSR0A = _BV(U2X0);
+	UCSR0C = _BV(UCSZ01) | _BV(UCSZ00);             // 8 data bits, no parity, 1 stop bit
+	UCSR0B = _BV(RXEN0) | _BV(TXEN0) | _BV(RXCIE0);
+#endif
 }
 
 void loop() {
   
+	// the trace checkpoint, before anything has changed in this loop
+	traceService();
+
 	/* Check what we are doing at the moment by checking button actions */
 	
 	// forceTimer
 	forcedFanTimer();
+
+	// stop the fan the moment its run budget is used up
+	if (fanRunning && !fanProtect && fanBudget() <= 0) {
+		fanTimer();
+		fanControl(lockFan);
+	}
 	
  	// turn the fan ON or OFF 
 	updateFan();
@@ -207,15 +642,30 @@ void loop() {
 		
 
 	// DHT
-	if (modeSettings == false){
+	// the humidity control runs in every mode; only the display belongs to the settings mode
 	
-		if(counter > dhtDataInterval) {   
-		  getDhtSensorData(); // get and print DHT data on lcd monitor.
-		  // reset counters
-		  counter = 0; 
-		}
+	// start a new conversion when it is time
+	if(!sensorConverting && (long)(millis() - nextDhtReading) >= 0) {   
+	  sensorStart();
 	}
-	else {
+
+	if(sensorConverting) {
+	  getDhtSensorData(); // get DHT data, control the fan and print them on lcd monitor once the conversion is done.
+	}
+
+	if(!sensorConverting && (long)(millis() - nextDhtReading) >= 0) {   
+	  // until the first valid reading try again as soon as the sensor allows
+	  if (firstDecisionTime == 0) {
+		nextDhtReading = millis() + dhtRetryInterval;
+	  }
+	  else {
+		nextDhtReading = millis() + dhtDataInterval;
+	  }
+	  // reset counters
+	  counter = 0; 
+	}
+
+	if (modeSettings == true){
 		// settings adjustment  
 		adjustSettings(); 
 	}
@@ -228,6 +678,18 @@ void loop() {
 	// PIR sensor
 	pirSensor();
 
+	// save the controller state when it changes
+	snapshotService();
+
+	// write pending settings and snapshot to EEPROM
+	eepromService();
+
+	// rotate the dashboard pages and tick the countdowns
+	dashboardService();
+
+	// answer the supervisor
+	modbusService();
+
 	// delay loop
 	delay(1); // loop goes every 1 milliseconds
 	counter++;
@@ -256,6 +718,7 @@ void updateFan(){
 
 				// remember state
 				previousButtonStateFan = fanButtonState;
+				traceButton(buttonFan, fanButtonState);
 
 				// turn the fan ON or OFF
 				// if it's ON it will be in that state for as long as the lock time (delclared in settings)
@@ -280,7 +743,7 @@ void updateFan(){
 					}	
 				}
 
-				forceTimer = 0;
+				forceStart = millis();
 				fanControl(lockFan);	
 			}
 		}
@@ -290,6 +753,7 @@ void updateFan(){
 			// the button has just been released
 			// reset previous button state to LOW
 			previousButtonStateFan = fanButtonState;  
+			traceButton(buttonFan, fanButtonState);
 		}
 
 	}
@@ -317,6 +781,7 @@ void updateLight(){
 
 				// remember state
 				previousButtonState = buttonState;
+				traceButton(buttonLight, buttonState);
 
 				// turn the light ON or OFF
 				if (light == false) {
@@ -336,6 +801,7 @@ void updateLight(){
 			// the button has just been released
 			// reset previous button state to LOW
 			previousButtonState = buttonState;  
+			traceButton(buttonLight, buttonState);
 		}
 	}
 }
@@ -362,6 +828,16 @@ void updateSettings(){
 				// remember the button state
 				previousButtonStateSettings = buttonState;
 
+#if TRACE_SERIAL
+				// holding the UP button while pressing settings dumps the trace instead
+				// (not recorded: the UP button is not traced outside the menu, a replay would open the menu)
+				if (modeSettings == false && digitalRead(buttonUp) == HIGH) {
+					traceDump();
+					return;
+				}
+#endif
+				traceButton(buttonSettings, buttonState);
+
 				// do any action we want after the button has been pressed
 				chooseFromSettings();
 			}
@@ -371,6 +847,7 @@ void updateSettings(){
 			// the button has just been released
 			// reset previous button state to LOW
 			previousButtonStateSettings = buttonState;  
+			traceButton(buttonSettings, buttonState);
 		}
 	}
 }
@@ -383,6 +860,7 @@ void updateSettings(){
 void chooseFromSettings() {
   
 	lcd.clear();
+	lcdShadowValid = false;   // the dashboard has to redraw the whole display afterwards
 
 	// mode settings is already active
 	if (modeSettings == true) {
@@ -444,14 +922,29 @@ void chooseFromSettings() {
 			lcd.setCursor(0,1);
 			lcd.print((String)storedSettings+" min");
 		}
-
 		else if (currentSetting == settings[7]) {
+			currentSetting = settings[8];
+			lcd.print(currentSetting);
+			storedSettings = eepromSettings[8];  // humidity rise starting the fan
+			lcd.setCursor(0,1);
+			lcd.print((String)storedSettings+"%/min");
+		}
+
+		else if (currentSetting == settings[8]) {
+			currentSetting = settings[9];
+			lcd.print(currentSetting);
+			storedSettings = eepromSettings[9];  // ambient light turning the light ON
+			lcd.setCursor(0,1);
+			printDarkLevel(storedSettings);
+		}
+
+		else if (currentSetting == settings[9]) {
 		  
 			// it was the last option, so we are living settings mode and need to UPDATE EEPROM
 			// the setting will be written to the EEPROM if they differs from previous.
-			for (int i = 0; i < sizeof(settings); i++) {
-				// By updating EEPROM we write it only if the value differs from the one already saved at the same address. 
-				EEPROM.update(i,eepromSettings[i]);
+			// eepromService() writes them in the background, so the fan control does not wait for the EEPROM.
+			for (int i = 0; i < sizeof(defaultSettings); i++) {
+				eepromDirty |= 1 << i;
 			}
 
 			// we are exiting the settings mode
@@ -461,6 +954,10 @@ void chooseFromSettings() {
 			lcd.print("Saving");
 			lcd.setCursor(0,1);
 			lcd.print("settings...");
+
+			// the dashboard comes back with the next page, a whole page time later
+			dashboardHeld = true;
+			dashboardPageStart = millis();
 		}
 
 	}
@@ -506,6 +1003,7 @@ void adjustSettings() {
 
 				// remember the button state
 				previousButtonStateAdjustUp = buttonState;
+				traceButton(buttonUp, buttonState);
 		
 			
 				// do any action we want after the button has been pressed
@@ -533,6 +1031,12 @@ void adjustSettings() {
 				else if (currentSetting == settings[7]) {
 					writeSettings(7,1,true);
 				}
+				else if (currentSetting == settings[8]) {
+					writeSettings(8,1,true);
+				}
+				else if (currentSetting == settings[9]) {
+					writeSettings(9,5,true);
+				}
 			}
 		}
 		else if (previousButtonStateAdjustUp != buttonState) {
@@ -540,6 +1044,7 @@ void adjustSettings() {
 			// the button has just been released
 			// reset previous button state to LOW
 			previousButtonStateAdjustUp = buttonState;  
+			traceButton(buttonUp, buttonState);
 		}
 	}
   
@@ -563,6 +1068,7 @@ void adjustSettings() {
 
 				// remember the button state
 				previousButtonStateAdjustDown = buttonState;
+				traceButton(buttonDown, buttonState);
     
         
 				// do any action we want after the button has been pressed
@@ -590,6 +1096,12 @@ void adjustSettings() {
 				else if (currentSetting == settings[7]) {
 					writeSettings(7,1,false);
 				}
+				else if (currentSetting == settings[8]) {
+					writeSettings(8,1,false);
+				}
+				else if (currentSetting == settings[9]) {
+					writeSettings(9,5,false);
+				}
 			}
 		}
 		else if (previousButtonStateAdjustDown != buttonState) {
@@ -597,6 +1109,7 @@ void adjustSettings() {
 			// the button has just been released
 			// reset previous button state to LOW
 			previousButtonStateAdjustDown = buttonState;  
+			traceButton(buttonDown, buttonState);
 		}
 	} 
 }
@@ -605,6 +1118,7 @@ void adjustSettings() {
    Increment od decrement the value of given settings. 
  */
 void writeSettings(byte addr, byte i, bool inc){
+	byte previous = eepromSettings[addr];
 
 	lcd.clear();
 	lcd.print(currentSetting);   // setting name
@@ -664,6 +1178,8 @@ void writeSettings(byte addr, byte i, bool inc){
 	}
 
 
+	traceSetting(0, addr, previous, eepromSettings[addr]);
+
 	// print the value of given setting
 	lcd.setCursor(0, 1); // column, row 
 	
@@ -691,6 +1207,12 @@ void writeSettings(byte addr, byte i, bool inc){
 	else if (addr == 7) {
 		lcd.print((String)eepromSettings[7]+" min");
 	}
+	else if (addr == 8) {
+		lcd.print((String)eepromSettings[8]+"%/min");
+	}
+	else if (addr == 9) {
+		printDarkLevel(eepromSettings[9]);
+	}
 	else{
 		lcd.print(storedSettings);
 	}
@@ -708,80 +1230,133 @@ void writeSettings(byte addr, byte i, bool inc){
 }
 
 /*
- * get data from DHT sensor and print them on lcd
+ * get data from DHT sensor, control the fan and print them on lcd
  */ 
 void getDhtSensorData() {
 
-	  float h = dht.readHumidity();     // humadity
-	  float t = dht.readTemperature();  // temperature as Celsius
-	  
-	  // clear lcd
-	  lcd.clear();
-	  
+	  float h = NAN;  // humadity (a failed reading may leave it as it is)
+	  float t = NAN;  // temperature as Celsius
+	  byte sensorState = sensorRead(h, t);
 
+	  // the conversion is still running; come back in the next loop
+	  if (sensorState == sensorBusy) {
+		return;
+	  }
 
 	  // Check if any reads failed and exit early (to try again).
-	  if (isnan(h) || isnan(t)) {
-		lcd.print("DHT sensor fail!");
+	  if (sensorState == sensorFail) {
+		traceDht(NAN, NAN);
+		sensorFailed = true;
+		dashboardReady = true;
+		dashboardDraw();
 		return;
 	  }
+
+	  traceDht(h, t);
+
+	  // remember the reading for the supervisor and the dashboard
+	  sensorFailed = false;
+	  lastHumidity = round(h*10);
+	  lastTemperature = round(t*10);
+	  sparkAddReading(round(h));
 	  
-	  // print temperature
-	  lcd.print((String)t+(char)223+"C");
+	  dashboardReady = true;
+	  dashboardDraw();
 	  
-	  // print humidity
-	  lcd.setCursor(10, 0); // column, row
-	  lcd.print("H: "+String(round(h))+"%");
+	  // how fast the humidity changes (tenths of % per minute)
+	  riseAddReading(lastHumidity);
+	  int slope = riseSlope();
+	  // only close below the limit: a fan started on a rise far below it runs longer than it saves
+	  bool rising = eepromSettings[8] != 0 && riseCount == riseWindow && slope >= eepromSettings[8]*10 && h + riseNearBand >= eepromSettings[2];
+	  // a lock started below the limit holds while the humidity still rises at half the trigger
+	  bool stillRising = eepromSettings[8] != 0 && riseCount == riseWindow && slope >= eepromSettings[8]*5;
+
+	  // the early release holds while the humidity keeps falling near the limit: it ends when the humidity
+	  // is down to the limit, stops falling or is out of the band again, so a level above the limit runs the fan
+	  if (riseReleased && (h <= eepromSettings[2] || slope >= 0 || h > eepromSettings[2] + riseNearBand)) {
+		riseReleased = false;
+	  }
 	  
 	  // set the fan lock ON or OFF (true or false)
 	  
-	  // HUMIDITY has risen to high
-	  if (h > eepromSettings[2] && lockFan == false && eepromSettings[4] != 0) {  
+	  // HUMIDITY has risen to high or it is rising fast
+	  if (((h > eepromSettings[2] && !riseReleased) || rising) && lockFan == false && eepromSettings[4] != 0) {  
 		lockFan = true;
 		lockStart = millis();
 	  }
 	  // HUMIDITY is not high any more, but lock is active. Release the lock.
-	  else if (h <= eepromSettings[2] && lockFan == true && millis()-lockStart > eepromSettings[4]*60000){  
+	  else if (h <= eepromSettings[2] && !stillRising && lockFan == true && millis()-lockStart > minutesToMillis(eepromSettings[4])){  
+		lockFan = false;
+	  }
+	  // HUMIDITY is falling and it is almost down to the limit. Release the lock a bit earlier.
+	  else if (eepromSettings[8] != 0 && slope < 0 && h <= eepromSettings[2] + riseNearBand && lockFan == true && millis()-lockStart > minutesToMillis(eepromSettings[4])){  
 		lockFan = false;
+		riseReleased = true;
 	  }
 	  
 	  // timer
-	  fanTimer(lockFan);
+	  fanTimer();
 
 	  // turn the fan ON or OFF
 	  fanControl(lockFan);
 
+	  // remember how long it took from power-on to the first decision made on a valid reading
+	  if (firstDecisionTime == 0) {
+		firstDecisionTime = max(millis(), 1UL);
+	  }
 }
 
-/* 
- * Count the time of the fun turned on.
- * - parameter bool fan: 
- * --  true: fan is running
- * --  false: fan is NOT running
- */ 
-void fanTimer(bool fan){
-			
-	// fan is resting or is turned OFF; increment the allowed time for the fan to be turned ON while protection time.
-	if (fanProtect || !fan || fanForced == 2){
-		fanWorkingTimeAllowed = fanWorkingTimeAllowed+dhtDataInterval;
+/*
+ * The fan run budget in millisecs, brought up to date with the real time passed since the last call.
+ * It is a token bucket holding at most the fan max run time:
+ * it drains 1 millisec per millisec while the fan runs and refills at fanRefillRate % while the fan is OFF.
+ * It is called every loop, so the part of a millisec the refill does not fill is carried to the next call
+ * (fanRefillCarry) instead of being rounded away.
+ */
+long fanBudget(){
+
+	unsigned long now = millis();
+	unsigned long elapsed = now - fanBudgetTime;
+	long capacity = minutesToMillis(eepromSettings[5]);
+
+	fanBudgetTime = now;
+
+	if (fanRunning) {
+		fanWorkingTimeAllowed = (elapsed >= fanWorkingTimeAllowed) ? 0 : fanWorkingTimeAllowed - elapsed;
+		fanRefillCarry = 0;
+	}
+	// refill; a long enough break fills it up without overflowing elapsed * fanRefillRate
+	else if (elapsed >= capacity) {
+		fanWorkingTimeAllowed = capacity;
+		fanRefillCarry = 0;
+	}
+	else {
+		unsigned long refill = elapsed * fanRefillRate + fanRefillCarry;
+		fanWorkingTimeAllowed = fanWorkingTimeAllowed + refill / 100;
+		fanRefillCarry = refill % 100;
 	}
-	// fan is working; decrement the allowed time for the fan to be turned ON
-	else if (fan) {
-		fanWorkingTimeAllowed = fanWorkingTimeAllowed-dhtDataInterval;		
+
+	// make sure do not exceed allowed maximum fan working time (the setting can be lowered at any time).
+	if (fanWorkingTimeAllowed > capacity) {  
+		fanWorkingTimeAllowed = capacity;
 	}
 
-	// make sure do not exceed allowed maximum fan working time.
-	if (fanWorkingTimeAllowed >= eepromSettings[5]*60000) {  
-		fanWorkingTimeAllowed = eepromSettings[5]*60000;
-	}		
+	return fanWorkingTimeAllowed;
+}
+
+/* 
+ * Turn the fan protection ON when the run budget is used up
+ * and OFF when the fan has rested long enough.
+ */ 
+void fanTimer(){
 	
 	// Turn the protection on or off
-	if (fanWorkingTimeAllowed <= 0){
+	if (!fanProtect && fanBudget() <= 0){
 		fanProtect = true;
 		fanStopTime = millis();
 	}
 	// wait untill fan cool down
-	else if (fanProtect && millis()-fanStopTime < eepromSettings[6]*60000) {
+	else if (fanProtect && millis()-fanStopTime < minutesToMillis(eepromSettings[6])) {
 		fanProtect = true;
 	}
 	// continue resting if the light is OFF
@@ -789,8 +1364,9 @@ void fanTimer(bool fan){
 		fanProtect = true;
 	}
 	// when the time for to cool down passed reset the allowed max running time
-	else if (fanProtect && millis()-fanStopTime >= eepromSettings[6]*60000) {
-		fanWorkingTimeAllowed = eepromSettings[5]*60000;
+	else if (fanProtect) {
+		fanBudget();
+		fanWorkingTimeAllowed = minutesToMillis(eepromSettings[5]);
 		fanProtect = false;
 	}
 	// turn OFF the protection
@@ -806,14 +1382,20 @@ void fanTimer(bool fan){
  */
 void pirSensor(){
  
-	if (millis() > 30000) { // pir sensor need that time to calibrate
+	if (millis() > pirCalibrationTime) { // pir sensor need that time to calibrate; until then the light stays ON
 	
 		if (readPirSensor == true) {
 		
+			tracePir(digitalRead(pirPin));
+
 			// Note the HIGH signal is frozen for at least 3 seconds - depend on potentiometer set.
 			if(digitalRead(pirPin) == HIGH){
-				digitalWrite(ledPin, HIGH);  // the light is ON
+				// a motion turns the light ON only when it is dark enough; the light which is ON stays ON
+				if (digitalRead(ledPin) == HIGH || ambientIsDark()) {
+					digitalWrite(ledPin, HIGH);  // the light is ON
+				}
 				lowLock = false;
+				traceOutputs();
 			}
 
 			// Note the LOW signal is frozen for approx 5 seconds
@@ -828,12 +1410,12 @@ void pirSensor(){
 				}
 
 				// lock time last longer than sustainLight.
-				if(lowLock && millis() - lowInTime > eepromSettings[7]*60000){
+				if(lowLock && millis() - lowInTime > minutesToMillis(eepromSettings[7])){
 					digitalWrite(ledPin, LOW);  // turn the light OFF
+					traceOutputs();
 					
 					// display info
-					lcd.setCursor(0,1);
-					lcd.print("Light is OFF    ");
+					statusShow(statusLightOff);
 				}
 			}
 			
@@ -853,22 +1435,29 @@ void forcedFanTimer(){
 	// fan is forced ON
 	if (fanForced == 1) {
 	
-		// increment timer
-		forceTimer = forceTimer+1;
-		
 		// turn the forcing OFF
-		if (forceTimer >= eepromSettings[5]*60000) {
+		if (millis() - forceStart >= minutesToMillis(eepromSettings[5])) {
 			fanForced = 0;
+			fanTimer();
+			fanControl(lockFan);
 		}
 	}
 }
 
+/*
+ * Settings keep minutes; the timers count millisecs.
+ * Multiply in unsigned long - an int on atmega328 has only 16 bits.
+ */
+unsigned long minutesToMillis(unsigned int minutes){
+	return minutes * 60000UL;
+}
+
 /*
  * Turn the fan ON or OFF and print the state.
  */ 
 void fanControl(bool on){
 	
-	lcd.setCursor(0,1);
+	byte fanState;	// what to print (one of statusMessages[])
 	
 	// NORMAL MODE
 	if (fanForced == 0) {
@@ -877,23 +1466,23 @@ void fanControl(bool on){
 		if (on && !fanProtect){		
 			// fan is ON
 			digitalWrite(relayFan, LOW);
-			lcd.print("Fan is ON       ");
+			fanState = statusFanOn;
 			//lcd.print(fanWorkingTimeAllowed/1000);
 		}
 		// the fan should rest;
 		else if (on && fanProtect) {
 			digitalWrite(relayFan, HIGH); // turn the fan OFF (protection mode)
-			lcd.print("Fan is resting  ");		
+			fanState = statusFanResting;		
 		}
 		// humidity is low
 		else if (!on) {
 			digitalWrite(relayFan, HIGH); // turn the fan OFF
-			lcd.print("Fan is OFF  ");		
+			fanState = statusFanOff;		
 		}
 		else {
 			// fan is OFF
 			digitalWrite(relayFan, HIGH);
-			lcd.print("Fan is OFF ???  ");	
+			fanState = statusFanUnknown;	
 			//lcd.print(fanWorkingTimeAllowed/1000);
 		}
 		
@@ -903,10 +1492,1357 @@ void fanControl(bool on){
 	// FORCED MODE
 	else if (fanForced == 1) {
 		digitalWrite(relayFan, LOW); // force the fan to turn ON
-		lcd.print("Fan forced ON   "); 
+		fanState = statusFanForcedOn; 
 	}
 	else{
 		digitalWrite(relayFan, HIGH); // force the fan to turn OFF
-		lcd.print("Fan forced OFF  ");
+		fanState = statusFanForcedOff;
+	}
+
+	// print the state
+	statusShow(fanState);
+
+	// settle the run budget before it starts draining or refilling
+	if (fanRunning != (digitalRead(relayFan) == LOW)) {
+		fanBudget();
+		fanRunning = !fanRunning;
+	}
+
+	traceOutputs();
+}
+
+
+/*
+ * AMBIENT LIGHT
+ * Start the ADC converting the light sensor on every Timer0 overflow.
+ */
+void ambientBegin(){
+	ADMUX = _BV(REFS0) | ambientChannel;    // AVcc reference
+	ADCSRB = _BV(ADTS2);                    // auto trigger source: Timer0 overflow (millis() keeps Timer0 running)
+	ADCSRA = _BV(ADEN) | _BV(ADATE) | _BV(ADIE) | _BV(ADPS2) | _BV(ADPS1) | _BV(ADPS0);  // 125 kHz ADC clock
+}
+
+ISR(ADC_vect){
+	ambientSum += ADC;
+	if (++ambientCount == ambientSamples) {
+		ambientAverage = ambientSum / ambientSamples;
+		ambientSum = 0;
+		ambientCount = 0;
+	}
+}
+
+/*
+ * The ambient light in the units of the "Dark level" setting (0 - 255).
+ */
+byte ambientLevel(){
+	unsigned int average;
+
+	// the interrupt may change both bytes in between
+	noInterrupts();
+	average = ambientAverage;
+	interrupts();
+
+	return average >> 2;
+}
+
+/*
+ * Is it dark enough to turn the light ON?
+ * It gets dark below "Dark level" and bright again at "Dark level" + ambientHysteresis (at most 255),
+ * so a level near the threshold does not flip the answer back and forth.
+ */
+bool ambientIsDark(){
+
+	// no light sensor
+	if (eepromSettings[9] == 0) {
+		return true;
+	}
+
+	byte level = ambientLevel();
+	bool dark = ambientDark;
+
+	// near the top of the scale the hysteresis is cut, so the full light is still bright
+	if (level < eepromSettings[9]) {
+		dark = true;
+	}
+	else if (level >= min(eepromSettings[9] + ambientHysteresis, 255)) {
+		dark = false;
+	}
+	if (dark != ambientDark) {
+		ambientDark = dark;
+		traceAmbient(dark, level);
+	}
+	return ambientDark;
+}
+
+/*
+ * Print the "Dark level" setting with the light measured now, to make it easy to set.
+ */
+void printDarkLevel(byte level){
+	if (level == 0) {
+		lcd.print("OFF");
+	}
+	else {
+		lcd.print((String)level+" now "+String(ambientLevel()));
+	}
+}
+
+/*
+ * DASHBOARD
+ * Rotate the pages and redraw the page shown every dashboardRefresh, so the countdowns tick.
+ */
+void dashboardService(){
+
+	if (modeSettings == true || !dashboardReady) {
+		return;
+	}
+
+	if (millis() - dashboardPageStart >= dashboardPageTime) {
+		dashboardPage = (dashboardPage + 1) % dashboardPages;
+		dashboardPageStart = millis();
+		dashboardHeld = false;
+		dashboardDraw();
+	}
+	else if (millis() - dashboardDrawTime >= dashboardRefresh) {
+		dashboardDraw();
+	}
+}
+
+/*
+ * Draw the page shown unless the settings mode or its closing message owns the display.
+ */
+void dashboardDraw(){
+
+	if (modeSettings == true || !dashboardReady || dashboardHeld) {
+		return;
+	}
+
+	dashboardDrawTime = millis();
+	memset(lcdFrame, ' ', sizeof(lcdFrame));
+
+	switch (dashboardPage) {
+
+		// temperature, humidity and the fan state
+		case 0:
+			if (sensorFailed) {
+				dashboardPrint(0, 0, "DHT sensor fail!");
+			}
+			else {
+				dashboardPrint(0, 0, (String)(lastTemperature/10.0)+(char)223+"C");
+				dashboardPrint(10, 0, "H: "+String(round(lastHumidity/10.0))+"%");
+			}
+			dashboardPrint(0, 1, statusMessages[statusLine]);
+			break;
+
+		// humidity sparkline with the range it is scaled to
+		case 1: {
+			byte low, high;
+			sparkDraw(low, high);
+			dashboardPrint(0, 0, "H");
+			for (byte g = 0; g < 8; g++) {
+				lcdFrame[0][2 + g] = g;    // custom characters 0 - 7
+			}
+			dashboardPrint(11, 0, String(round(lastHumidity/10.0))+"%");
+			dashboardPrint(0, 1, "min "+String(low)+"% max "+String(high)+"%");
+			break;
+		}
+
+		// fan run budget and rest countdown
+		case 2:
+			dashboardPrint(0, 0, "Fan run "+String(fanBudget()/1000)+"s");
+			if (fanProtect && millis() - fanStopTime < minutesToMillis(eepromSettings[6])) {
+				dashboardPrint(0, 1, "Rest "+String((minutesToMillis(eepromSettings[6]) - (millis() - fanStopTime)) / 1000)+"s");
+			}
+			else if (fanProtect) {
+				dashboardPrint(0, 1, "Rest: light OFF");
+			}
+			else {
+				dashboardPrint(0, 1, "Not resting");
+			}
+			break;
+
+		// light lock countdown and the ambient light
+		case 3:
+			dashboardPrint(0, 0, "Light lock");
+			if (eepromSettings[9] != 0) {
+				dashboardPrint(12, 0, String(ambientLevel()));
+			}
+			if (digitalRead(ledPin) == LOW) {
+				dashboardPrint(0, 1, "Light is OFF");
+			}
+			else if (lowLock && millis() - lowInTime < minutesToMillis(eepromSettings[7])) {
+				unsigned long left = (minutesToMillis(eepromSettings[7]) - (millis() - lowInTime)) / 1000;
+				dashboardPrint(0, 1, "OFF in "+String(left / 60)+"m "+String(left % 60)+"s");
+			}
+			else {
+				dashboardPrint(0, 1, "Motion");
+			}
+			break;
+
+		// free memory now and at worst, the heap and its free blocks
+		case 4:
+			dashboardPrint(0, 0, "Free "+String(memoryFree())+" min "+String(memoryStackMin()));
+			dashboardPrint(0, 1, "Heap "+String(memoryHeapSize())+" fl "+String(memoryFreeList()));
+			break;
+	}
+
+	lcdFlush();
+}
+
+/*
+ * Show one of statusMessages[] on the first page.
+ */
+void statusShow(byte message){
+	statusLine = message;
+	traceStatus(message);
+	dashboardDraw();
+}
+
+/*
+ * Put text into the frame at column col of row (cut at the end of the row).
+ */
+void dashboardPrint(byte col, byte row, const String &text){
+	for (byte i = 0; i < text.length() && col + i < 16; i++) {
+		lcdFrame[row][col + i] = text[i];
+	}
+}
+
+/*
+ * Send the cells of the frame which differ from what the display shows.
+ * The cursor moves on by itself after each character, so it is set only when a cell is skipped.
+ */
+void lcdFlush(){
+
+	for (byte row = 0; row < 2; row++) {
+		bool cursorHere = false;
+
+		for (byte col = 0; col < 16; col++) {
+			if (lcdShadowValid && lcdFrame[row][col] == lcdShadow[row][col]) {
+				cursorHere = false;
+				continue;
+			}
+			if (!cursorHere) {
+				lcd.setCursor(col, row);
+				lcdWrites++;
+				cursorHere = true;
+			}
+			lcd.write(lcdFrame[row][col]);
+			lcdWrites++;
+			lcdShadow[row][col] = lcdFrame[row][col];
+		}
+	}
+	lcdShadowValid = true;
+}
+
+/*
+ * Add a humidity reading to the sparkline history, one value per sparkSampleTime.
+ */
+void sparkAddReading(byte humidity){
+
+	if (sparkCount > 0 && millis() - sparkTime < sparkSampleTime) {
+		return;
+	}
+
+	sparkTime = millis();
+	sparkHistory[sparkNext] = humidity;
+	sparkNext = (sparkNext + 1) % sparkColumns;
+	if (sparkCount < sparkColumns) {
+		sparkCount++;
+	}
+}
+
+/*
+ * Draw the history as bars into the 8 custom characters, the newest value on the right.
+ * The bars are scaled between the lowest and the highest value (at least 8 % apart);
+ * low and high are set to the real lowest and highest value for the legend.
+ * Only the glyph rows which differ from the CGRAM are written.
+ */
+void sparkDraw(byte &low, byte &high){
+
+	low = 100;
+	high = 0;
+	for (byte i = 0; i < sparkCount; i++) {
+		low = min(low, sparkHistory[i]);
+		high = max(high, sparkHistory[i]);
+	}
+	if (sparkCount == 0) {
+		low = high = 0;
+	}
+	// the top of the scale; a flat history is drawn low instead of jumping between 1 and 8 pixels
+	byte top = max(high, low + 8);
+
+	// bar height of each column (1 - 8 pixels; 0 -> no value yet); the oldest value is on the left
+	byte levels[sparkColumns];
+	for (byte column = 0; column < sparkColumns; column++) {
+		if (column < sparkColumns - sparkCount) {
+			levels[column] = 0;
+		}
+		else {
+			levels[column] = 1 + (unsigned int)(sparkHistory[(sparkNext + column) % sparkColumns] - low) * 7 / (top - low);
+		}
+	}
+
+	bool cgramAddressed = false;   // the CGRAM address counter points to the next row already
+
+	for (byte g = 0; g < 8; g++) {
+		for (byte row = 0; row < 8; row++) {
+			byte bits = 0;
+
+			for (byte c = 0; c < 5; c++) {
+				if (levels[g*5 + c] > 7 - row) {
+					bits |= 0x10 >> c;
+				}
+			}
+
+			if (sparkGlyphsValid && sparkGlyphs[g][row] == bits) {
+				cgramAddressed = false;
+				continue;
+			}
+			if (!cgramAddressed) {
+				lcd.command(0x40 | (g << 3) | row);   // set CGRAM address
+				lcdWrites++;
+				cgramAddressed = true;
+			}
+			lcd.write(bits);
+			lcdWrites++;
+			sparkGlyphs[g][row] = bits;
+		}
+	}
+	sparkGlyphsValid = true;
+}
+
+/*
+ * HUMIDITY RISE
+ * Average the readings into one sample per riseSampleTime and slide the window.
+ * The sums are updated in place, so adding a sample does not depend on the window size.
+ */
+void riseAddReading(int humidity){
+
+	riseAccumulator += humidity;
+	riseReadings++;
+	if (riseReadings < max(riseSampleTime / dhtDataInterval, 1U)) {
+		return;
+	}
+
+	int sample = riseAccumulator / riseReadings;
+	riseAccumulator = 0;
+	riseReadings = 0;
+
+	if (riseCount < riseWindow) {
+		// the window is filling up; the new sample gets the next index
+		riseSumXY += (long)riseCount * sample;
+		riseSumY += sample;
+		riseCount++;
+	}
+	else {
+		// drop the oldest sample; all the other samples move one index down
+		int oldest = riseSamples[riseNext];
+		riseSumXY = riseSumXY - (riseSumY - oldest) + (long)(riseWindow - 1) * sample;
+		riseSumY = riseSumY - oldest + sample;
+	}
+
+	riseSamples[riseNext] = sample;
+	riseNext = (riseNext + 1) % riseWindow;
+}
+
+/*
+ * The least squares slope of the samples in tenths of % per minute (0 until there are 2 samples).
+ * slope = (n*sum(xy) - sum(x)*sum(y)) / (n*sum(x*x) - sum(x)*sum(x)) where x = 0 ... n-1
+ */
+int riseSlope(){
+	long n = riseCount;
+
+	if (n < 2) {
+		return 0;
+	}
+
+	long sumX = n * (n - 1) / 2;
+	long sumXX = (n - 1) * n * (2*n - 1) / 6;
+	long numerator = n * riseSumXY - sumX * riseSumY;
+	long denominator = n * sumXX - sumX * sumX;
+
+	return numerator * (60000 / riseSampleTime) / denominator;
+}
+
+/*
+ * HUMIDITY SENSOR
+ * Prepare the sensor to work.
+ */
+void sensorBegin(){
+#if SENSOR_TYPE == SENSOR_DHT22
+	dht.begin();
+#elif SENSOR_TYPE == SENSOR_SHT3X
+	twiBegin();
+#endif
+}
+
+/*
+ * Start a new conversion. It never waits for the sensor.
+ */
+void sensorStart(){
+#if SENSOR_TYPE == SENSOR_SHT3X
+	// single shot measurement, high repeatability, clock stretching disabled
+	twiBuffer[0] = 0x24;
+	twiBuffer[1] = 0x00;
+	twiStart(shtAddress << 1, 2);
+	shtStartTime = millis();
+	shtReading = false;
+#endif
+	sensorConverting = true;
+}
+
+/*
+ * Check the conversion started by sensorStart().
+ * Returns sensorBusy while it is running, otherwise sensorReady with h and t set or sensorFail.
+ */
+byte sensorRead(float &h, float &t){
+#if SENSOR_TYPE == SENSOR_DHT22
+	// the DHT library reads the sensor at once (about 5 millisecs with interrupts disabled)
+	h = dht.readHumidity();
+	t = dht.readTemperature();
+	sensorConverting = false;
+
+	if (isnan(h) || isnan(t)) {
+		return sensorFail;
+	}
+	return sensorReady;
+
+#elif SENSOR_TYPE == SENSOR_SHT3X
+	if (twiState == twiBusy) {
+		return sensorBusy;
+	}
+
+	// the measure command has been sent; read the result when the conversion is done
+	if (!shtReading) {
+		if (twiState == twiError) {
+			sensorConverting = false;
+			return sensorFail;
+		}
+		if (millis() - shtStartTime < shtMeasureTime) {
+			return sensorBusy;
+		}
+		twiStart((shtAddress << 1) | 1, 6);
+		shtReading = true;
+		return sensorBusy;
+	}
+
+	sensorConverting = false;
+
+	// temperature MSB, LSB, CRC, humidity MSB, LSB, CRC
+	if (twiState == twiError || shtCrc(twiBuffer) != twiBuffer[2] || shtCrc(twiBuffer+3) != twiBuffer[5]) {
+		return sensorFail;
+	}
+
+	t = -45 + 175.0 * word(twiBuffer[0], twiBuffer[1]) / 65535;
+	h = 100.0 * word(twiBuffer[3], twiBuffer[4]) / 65535;
+	return sensorReady;
+#endif
+}
+
+#if SENSOR_TYPE == SENSOR_SHT3X
+/*
+ * SHT3x CRC-8 of two data bytes (polynomial 0x31, initial value 0xFF).
+ */
+byte shtCrc(byte* data){
+	byte crc = 0xFF;
+
+	for (byte i = 0; i < 2; i++) {
+		crc ^= data[i];
+		for (byte b = 0; b < 8; b++) {
+			crc = (crc & 0x80) ? (crc << 1) ^ 0x31 : crc << 1;
+		}
+	}
+	return crc;
+}
+
+/*
+ * I2C (TWI) master driven by the TWI interrupt, so the loop never waits for the bus.
+ */
+void twiBegin(){
+	TWSR = 0;                              // prescaler 1
+	TWBR = ((F_CPU / 100000L) - 16) / 2;   // 100 kHz
+	TWCR = _BV(TWEN);
+}
+
+/*
+ * Start a transfer of length bytes: twiBuffer is sent to or filled from the slave.
+ * - address: slave address shifted left with the read (1) or write (0) bit
+ */
+void twiStart(byte address, byte length){
+	twiAddress = address;
+	twiLength = length;
+	twiCount = 0;
+	twiState = twiBusy;
+	TWCR = _BV(TWINT) | _BV(TWSTA) | _BV(TWEN) | _BV(TWIE);
+}
+
+ISR(TWI_vect){
+	switch (TWSR & 0xF8) {
+		case 0x08:	// START sent
+			TWDR = twiAddress;
+			TWCR = _BV(TWINT) | _BV(TWEN) | _BV(TWIE);
+			break;
+		case 0x18:	// address sent, ACK received
+		case 0x28:	// data sent, ACK received
+			if (twiCount < twiLength) {
+				TWDR = twiBuffer[twiCount++];
+				TWCR = _BV(TWINT) | _BV(TWEN) | _BV(TWIE);
+			}
+			else {
+				TWCR = _BV(TWINT) | _BV(TWSTO) | _BV(TWEN);
+				twiState = twiIdle;
+			}
+			break;
+		case 0x40:	// address sent, ACK received; ACK the bytes but the last one
+			TWCR = _BV(TWINT) | _BV(TWEN) | _BV(TWIE) | (twiLength > 1 ? _BV(TWEA) : 0);
+			break;
+		case 0x50:	// data received, ACK sent
+			twiBuffer[twiCount++] = TWDR;
+			TWCR = _BV(TWINT) | _BV(TWEN) | _BV(TWIE) | (twiCount < twiLength - 1 ? _BV(TWEA) : 0);
+			break;
+		case 0x58:	// last data received, NACK sent
+			twiBuffer[twiCount++] = TWDR;
+			TWCR = _BV(TWINT) | _BV(TWSTO) | _BV(TWEN);
+			twiState = twiIdle;
+			break;
+		default:	// NACK (the sensor is busy or missing) or the bus is lost
+			TWCR = _BV(TWINT) | _BV(TWSTO) | _BV(TWEN);
+			twiState = twiError;
+			break;
+	}
+}
+#endif
+
+/*
+ * Write one pending setting or snapshot byte to EEPROM.
+ * An EEPROM write takes 3.3 ms, so only one byte is written per loop and only when the EEPROM is ready.
+ * The settings count is written after the settings, so a power cut in between writes the defaults again.
+ */
+void eepromService(){
+
+	if ((eepromDirty == 0 && !settingsCountDirty && snapshotPending == 0) || !eeprom_is_ready()) {
+		return;
+	}
+
+	for (int i = sizeof(eepromDirty)*8 - 1; i >= 0; i--) {
+		if (eepromDirty & (1 << i)) {
+			eepromDirty &= ~(1 << i);
+			EEPROM.update(i, eepromSettings[i]);
+			return;
+		}
+	}
+
+	if (settingsCountDirty) {
+		settingsCountDirty = false;
+		EEPROM.update(settingsCountAddress, settingsCount);
+		return;
+	}
+
+	// the snapshot
+	byte i = snapshotSize - snapshotPending;
+	EEPROM.update(snapshotAddress + snapshotSlot*snapshotSlotSize + i, snapshotBuffer[i]);
+	snapshotPending--;
+
+	// the next snapshot goes to the other slot
+	if (snapshotPending == 0) {
+		snapshotSlot ^= 1;
+	}
+}
+
+/*
+ * SNAPSHOT
+ * The flags part of the snapshot.
+ */
+byte snapshotStateFlags(){
+	return lockFan | (fanProtect << 1) | (light << 2) | ((digitalRead(relayFan) == LOW) << 3) | (fanForced << 4);
+}
+
+/*
+ * Take a snapshot when the state has changed or snapshotInterval has passed.
+ * eepromService() writes it in the background.
+ */
+void snapshotService(){
+
+	if (snapshotPending > 0) {
+		return;
+	}
+
+	byte flags = snapshotStateFlags();
+	unsigned long now = millis();
+
+	if (flags == snapshotFlags && now - snapshotTime < snapshotPeriod(flags)) {
+		return;
+	}
+
+	// the fan is OFF, not resting, not forced and its budget is full, or it has rested long enough and waits
+	// for the light (which can take all night; the budget is filled up when it ends): the last snapshot taken
+	// like that restores the same state, so the EEPROM is not worn by the same snapshot every snapshotPeriod
+	bool idle = ((flags & 0x3A) == 0 && fanBudget() >= minutesToMillis(eepromSettings[5]))
+		|| ((flags & 0x3A) == 0x02 && now - fanStopTime >= minutesToMillis(eepromSettings[6]));
+	if (flags == snapshotFlags && idle && snapshotIdle) {
+		snapshotTime = now;
+		return;
+	}
+
+	snapshotFlags = flags;
+	snapshotTime = now;
+	snapshotIdle = idle;
+
+	snapshotBuffer[0] = ++snapshotSequence;
+	snapshotBuffer[1] = flags;
+	snapshotPut(2, fanBudget() / 1000);
+	snapshotPut(4, (now - fanStopTime) / 1000);
+	snapshotPut(6, (now - lockStart) / 1000);
+	snapshotPut(8, (now - forceStart) / 1000);
+	snapshotBuffer[10] = snapshotCrc(snapshotBuffer);
+
+	snapshotPending = snapshotSize;
+}
+
+// how often to take a snapshot with the state in flags
+unsigned long snapshotPeriod(byte flags){
+	// fanProtect, fan relay or fanForced
+	return (flags & 0x3A) ? snapshotActiveInterval : snapshotInterval;
+}
+
+// store secs as 2 bytes; longer times are all the same for the timers
+void snapshotPut(byte pos, unsigned long secs){
+	secs = min(secs, 65535UL);
+	snapshotBuffer[pos] = lowByte(secs);
+	snapshotBuffer[pos + 1] = highByte(secs);
+}
+
+unsigned long snapshotGet(byte pos){
+	return word(snapshotBuffer[pos + 1], snapshotBuffer[pos]) * 1000UL;
+}
+
+byte snapshotCrc(byte* data){
+	byte crc = 0;
+
+	for (byte i = 0; i < snapshotSize - 1; i++) {
+		crc = _crc8_ccitt_update(crc, data[i]);
+	}
+	return crc;
+}
+
+/*
+ * Restore the state from the newer valid slot.
+ * The time between the snapshot and the reset is not known, so the timers are aged by half of the snapshot period.
+ */
+void snapshotRestore(){
+	bool valid[2];
+	byte sequence[2];
+
+	for (byte slot = 0; slot < 2; slot++) {
+		for (byte i = 0; i < snapshotSize; i++) {
+			snapshotBuffer[i] = EEPROM.read(snapshotAddress + slot*snapshotSlotSize + i);
+		}
+		valid[slot] = snapshotBuffer[10] == snapshotCrc(snapshotBuffer) && snapshotBuffer[1] != 0xFF;
+		sequence[slot] = snapshotBuffer[0];
+	}
+
+	// pick the newer slot; the sequence number wraps around
+	byte slot;
+	if (valid[0] && valid[1]) {
+		slot = ((int8_t)(sequence[1] - sequence[0]) > 0) ? 1 : 0;
+	}
+	else if (valid[0] || valid[1]) {
+		slot = valid[1] ? 1 : 0;
+	}
+	else {
+		return;
+	}
+
+	for (byte i = 0; i < snapshotSize; i++) {
+		snapshotBuffer[i] = EEPROM.read(snapshotAddress + slot*snapshotSlotSize + i);
+	}
+
+	byte flags = snapshotBuffer[1];
+	unsigned long now = millis();
+	unsigned long age = snapshotPeriod(flags) / 2;
+
+	snapshotSequence = snapshotBuffer[0];
+	snapshotSlot = slot ^ 1;
+
+	lockFan = flags & 1;
+	fanProtect = flags & 2;
+	fanForced = (flags >> 4) & 3;
+	fanStopTime = now - snapshotGet(4) - age;
+	lockStart = now - snapshotGet(6) - age;
+	forceStart = now - snapshotGet(8) - age;
+
+	// the fan run budget went on draining or refilling until the reset
+	fanWorkingTimeAllowed = snapshotGet(2);
+	if (flags & 8) {
+		fanWorkingTimeAllowed = (fanWorkingTimeAllowed > age) ? fanWorkingTimeAllowed - age : 0;
+	}
+	else {
+		long capacity = minutesToMillis(eepromSettings[5]);
+		fanWorkingTimeAllowed = (age >= capacity) ? capacity : min(fanWorkingTimeAllowed + age * fanRefillRate / 100, capacity);
+	}
+	fanBudgetTime = now;
+
+	// the lcd light; the light relay stays ON until the PIR sensor has calibrated
+	light = flags & 4;
+	analogWrite(bri, light ? eepromSettings[0] : 0);
+}
+
+/*
+ * TRACE RECORDER
+ * Append one record to the ring buffer. The oldest records are dropped when there is no room.
+ * - event, arg: the header byte nibbles
+ * - a, b: signed payload values
+ * - values: how many payload values the event carries (0, 1 or 2)
+ */
+void traceRecord(byte event, byte arg, long a, long b, byte values){
+#if TRACE_ENABLED
+	byte record[16];
+
+	// encode the record
+	byte n = traceHeader(record, event, arg);
+	if (values > 0) {
+		n = traceVarint(record, n, traceZigzag(a));
+	}
+	if (values > 1) {
+		n = traceVarint(record, n, traceZigzag(b));
+	}
+
+	traceAppend(record, n);
+	traceSinceCheckpoint += n;
+#endif
+}
+
+/*
+ * Write the header byte and the time since the previous record (not for DHT records). Returns the index after them.
+ */
+byte traceHeader(byte* record, byte event, byte arg){
+	byte n = 0;
+#if TRACE_ENABLED
+	unsigned long now = millis();
+
+	record[n++] = event | (arg << 4);
+	if (event != traceEventDht) {
+		n = traceVarint(record, n, now - traceLastTime);
+		traceLastTime = now;
+	}
+#endif
+	return n;
+}
+
+/*
+ * Copy an encoded record to the ring buffer, dropping the oldest records when there is no room.
+ */
+void traceAppend(byte* record, byte n){
+#if TRACE_ENABLED
+	while (traceUsed + n > sizeof(traceBuffer)) {
+		traceDropOldest();
+	}
+	traceRepeats = 0;
+
+	for (byte i = 0; i < n; i++) {
+		traceBuffer[traceHead++] = record[i];
+	}
+	traceUsed += n;
+#endif
+}
+
+/*
+ * Write a checkpoint when enough records have been written since the last one.
+ * It is called at the start of loop(), so the replay can start right there.
+ */
+void traceService(){
+#if TRACE_ENABLED
+	if (traceSinceCheckpoint >= traceCheckpointSpacing) {
+		traceCheckpoint();
+	}
+#endif
+}
+
+/*
+ * Record the state the replay needs to go on from this point (the layout is described at the TRACE RECORDER).
+ */
+void traceCheckpoint(){
+#if TRACE_ENABLED
+	byte record[96];
+	unsigned long now = millis();
+	byte menu = 0;
+
+	for (byte i = 0; i < settingsCount && modeSettings; i++) {
+		if (currentSetting == settings[i]) {
+			menu = i + 1;
+		}
+	}
+
+	byte n = traceHeader(record, traceEventState, 0);
+	byte start = ++n;      // the payload length goes before the payload
+
+	n = traceVarint(record, n, traceStateFlags());
+	n = traceVarint(record, n, menu);
+	n = traceVarint(record, n, storedSettings);
+	n = traceVarint(record, n, fanBudget());
+	n = traceVarint(record, n, min(now - fanStopTime, traceAgeLimit));
+	n = traceVarint(record, n, min(now - lockStart, traceAgeLimit));
+	n = traceVarint(record, n, min(now - forceStart, traceAgeLimit));
+	n = traceVarint(record, n, min(now - lowInTime, traceAgeLimit));
+	n = traceVarint(record, n, min(now - buttonPressTime, traceButtonAgeLimit));
+	n = traceVarint(record, n, min(now - fanButtonPressTime, traceButtonAgeLimit));
+	n = traceVarint(record, n, traceZigzag((long)(nextDhtReading - now)));
+	n = traceVarint(record, n, counter);
+	n = traceVarint(record, n, firstDecisionTime);
+	n = traceVarint(record, n, ambientLevel());
+
+	n = traceVarint(record, n, riseCount);
+	n = traceVarint(record, n, riseNext);
+	n = traceVarint(record, n, riseReadings);
+	n = traceVarint(record, n, traceZigzag(riseAccumulator));
+	int previous = 0;
+	for (byte i = 0; i < riseCount; i++) {
+		n = traceVarint(record, n, traceZigzag(riseSamples[i] - previous));
+		previous = riseSamples[i];
+	}
+
+	record[start - 1] = n - start;
+	traceAppend(record, n);
+	traceSinceCheckpoint = 0;
+#endif
+}
+
+/*
+ * The flags of a checkpoint:
+ * bit 0 lockFan, bit 1 fanProtect, bits 2-3 fanForced, bit 4 light, bit 5 fanRunning, bit 6 lowLock,
+ * bit 7 ambientDark, bit 8 sensorFailed, bit 9 readPirSensor, bit 10 fan relay pin, bit 11 light relay pin,
+ * bit 12 the last PIR output recorded, bits 13-17 previous state of the fan, light, settings, UP and DOWN buttons,
+ * bit 18 riseReleased, bits 19-21 statusLine
+ */
+unsigned long traceStateFlags(){
+	return lockFan | (fanProtect << 1) | (fanForced << 2) | (light << 4) | (fanRunning << 5) | (lowLock << 6)
+		| (ambientDark << 7) | ((unsigned int)sensorFailed << 8) | ((unsigned int)readPirSensor << 9)
+		| ((unsigned int)digitalRead(relayFan) << 10) | ((unsigned int)digitalRead(ledPin) << 11)
+#if TRACE_ENABLED
+		| ((unsigned int)traceLastPir << 12)
+#endif
+		| ((unsigned long)previousButtonStateFan << 13) | ((unsigned long)previousButtonState << 14)
+		| ((unsigned long)previousButtonStateSettings << 15) | ((unsigned long)previousButtonStateAdjustUp << 16)
+		| ((unsigned long)previousButtonStateAdjustDown << 17) | ((unsigned long)riseReleased << 18)
+		| ((unsigned long)statusLine << 19);
+}
+
+/*
+ * Drop the oldest record from the ring buffer.
+ * Its delta values are folded into the base values so the remaining trace can still be decoded.
+ */
+void traceDropOldest(){
+#if TRACE_ENABLED
+	byte header = traceBuffer[traceTail];
+	byte pos = traceTail + 1;
+
+	if ((header & 0x0F) != traceEventDht) {
+		traceBaseTime += traceReadVarint(pos);
+	}
+
+	if ((header & 0x0F) == traceEventDht && (header >> 4) == 0) {
+		traceBaseHumidity += traceUnzigzag(traceReadVarint(pos));
+		traceBaseTemperature += traceUnzigzag(traceReadVarint(pos));
+	}
+	else if ((header & 0x0F) == traceEventDht && (header >> 4) >= 3) {
+		traceBaseHumidity += (header >> 4) - 9;
+	}
+	else if ((header & 0x0F) == traceEventButton || (header & 0x0F) == traceEventAmbient || header == (traceEventDht | (2 << 4))) {
+		traceReadVarint(pos);
+	}
+	else if ((header & 0x0F) == traceEventSetting) {
+		traceReadVarint(pos);
+		traceReadVarint(pos);
+		traceReadVarint(pos);
+	}
+	else if ((header & 0x0F) == traceEventState) {
+		pos += traceBuffer[pos] + 1;
+	}
+
+	traceUsed -= (byte)(pos - traceTail);
+	traceTail = pos;
+#endif
+}
+
+/*
+ * Write value as a varint at out[n]. Returns the index after the last byte written.
+ */
+byte traceVarint(byte* out, byte n, unsigned long value){
+	while (value >= 0x80) {
+		out[n++] = (value & 0x7F) | 0x80;
+		value >>= 7;
+	}
+	out[n++] = value;
+	return n;
+}
+
+/*
+ * Read a varint from the ring buffer starting at pos. pos is moved after the varint.
+ */
+unsigned long traceReadVarint(byte &pos){
+	unsigned long value = 0;
+#if TRACE_ENABLED
+	byte shift = 0;
+	byte b;
+
+	do {
+		b = traceBuffer[pos++];
+		value |= (unsigned long)(b & 0x7F) << shift;
+		shift += 7;
+	} while (b & 0x80);
+#endif
+	return value;
+}
+
+// zigzag encoding keeps small negative values small: 0, -1, 1, -2 ... -> 0, 1, 2, 3 ...
+unsigned long traceZigzag(long value){
+	return value < 0 ? ((unsigned long)(-value) << 1) - 1 : (unsigned long)value << 1;
+}
+
+long traceUnzigzag(unsigned long value){
+	return (value & 1) ? -(long)(value >> 1) - 1 : (long)(value >> 1);
+}
+
+/*
+ * Record a DHT reading as the change against the previous reading (in tenths).
+ */
+void traceDht(float h, float t){
+#if TRACE_ENABLED
+	if (isnan(h) || isnan(t)) {
+		traceRecord(traceEventDht, 1, 0, 0, 0);
+		return;
+	}
+
+	int humidity = round(h*10);
+	int temperature = round(t*10);
+
+	// the same reading again: count it in the newest record when that is a repeat already
+	if (humidity == traceLastHumidity && temperature == traceLastTemperature) {
+		if (traceRepeats > 0 && traceRepeats < 127) {
+			traceBuffer[traceRepeatsAt] = ++traceRepeats;
+		}
+		else {
+			byte record[8];
+			byte n = traceHeader(record, traceEventDht, 2);
+			record[n++] = 1;
+			traceAppend(record, n);
+			traceSinceCheckpoint += n;
+			traceRepeats = 1;
+			traceRepeatsAt = traceHead - 1;
+		}
+		return;
+	}
+
+	// a small change of the humidity alone goes into the argument
+	int change = humidity - traceLastHumidity;
+	if (temperature == traceLastTemperature && change >= 3 - 9 && change <= 15 - 9) {
+		traceRecord(traceEventDht, change + 9, 0, 0, 0);
+	}
+	else {
+		traceRecord(traceEventDht, 0, change, temperature - traceLastTemperature, 2);
+	}
+	traceLastHumidity = humidity;
+	traceLastTemperature = temperature;
+#endif
+}
+
+/*
+ * Record a button edge (pressed or released).
+ */
+void traceButton(byte pin, byte state){
+	traceRecord(traceEventButton, state, pin, 0, 1);
+}
+
+/*
+ * Record the ambient light level when it has turned dark or bright.
+ */
+void traceAmbient(bool dark, byte level){
+	traceRecord(traceEventAmbient, dark, level, 0, 1);
+}
+
+/*
+ * Record a setting changed in the settings menu (source 0) or over Modbus (source 1) from previous to value.
+ */
+void traceSetting(byte source, byte addr, byte previous, byte value){
+#if TRACE_ENABLED
+	byte record[16];
+	byte n = traceHeader(record, traceEventSetting, source);
+
+	n = traceVarint(record, n, addr);
+	n = traceVarint(record, n, value);
+	n = traceVarint(record, n, previous);
+	traceAppend(record, n);
+	traceSinceCheckpoint += n;
+#endif
+}
+
+/*
+ * Record the PIR output when it has changed since the last reading.
+ */
+void tracePir(byte state){
+#if TRACE_ENABLED
+	if (state != traceLastPir) {
+		traceRecord(traceEventPir, state, 0, 0, 0);
+		traceLastPir = state;
+	}
+#endif
+}
+
+/*
+ * Record the state of both relays when a decision has changed any of them.
+ */
+void traceOutputs(){
+#if TRACE_ENABLED
+	byte outputs = digitalRead(relayFan) | (digitalRead(ledPin) << 1);
+
+	if (outputs != traceLastOutput) {
+		traceRecord(traceEventOutput, outputs, 0, 0, 0);
+		traceLastOutput = outputs;
+	}
+#endif
+}
+
+/*
+ * Record the status line when it changes (what the first page of the display shows).
+ */
+void traceStatus(byte message){
+#if TRACE_ENABLED
+	if (message != traceLastStatus) {
+		traceRecord(traceEventStatus, message, 0, 0, 0);
+		traceLastStatus = message;
+	}
+#endif
+}
+
+/*
+ * Dump the trace over serial:
+ * "TR", base time (4 bytes), base humidity and base temperature (2 bytes each),
+ * settingsCount (1 byte) and the settings now, length (2 bytes), records.
+ * All numbers are little endian.
+ */
+void traceDump(){
+#if TRACE_ENABLED && TRACE_SERIAL
+	Serial.write('T');
+	Serial.write('R');
+	for (byte i = 0; i < 4; i++) {
+		Serial.write((byte)(traceBaseTime >> (8*i)));
+	}
+	Serial.write(lowByte(traceBaseHumidity));
+	Serial.write(highByte(traceBaseHumidity));
+	Serial.write(lowByte(traceBaseTemperature));
+	Serial.write(highByte(traceBaseTemperature));
+	Serial.write((byte)settingsCount);
+	Serial.write(eepromSettings, settingsCount);
+	Serial.write(lowByte(traceUsed));
+	Serial.write(highByte(traceUsed));
+
+	byte pos = traceTail;
+	for (unsigned int i = 0; i < traceUsed; i++) {
+		Serial.write(traceBuffer[pos++]);
+	}
+#endif
+}
+
+
+/*
+ * MODBUS
+ * Answer a request once the RX interrupt has received it and the line has been silent for 3.5 characters.
+ */
+void modbusService(){
+#if MODBUS_ENABLED
+	noInterrupts();
+	if (!modbusFrameReady && modbusLength > 0 && micros() - modbusLastByte >= modbusSilence) {
+		modbusFrameReady = true;
+	}
+	interrupts();
+
+	if (modbusFrameReady) {
+		modbusProcess();
+		modbusLength = 0;
+		modbusFrameReady = false;
+	}
+#endif
+}
+
+#if MODBUS_ENABLED
+/*
+ * A byte has been received. A byte after 3.5 characters of silence starts a new frame;
+ * a frame for another controller is dropped here, so it never holds up the next request.
+ */
+ISR(USART_RX_vect){
+	unsigned long now = micros();
+	byte b = UDR0;
+
+	if (modbusFrameReady || modbusSending) {
+		modbusLastByte = now;
+		return;
+	}
+	if (modbusLength > 0 && now - modbusLastByte >= modbusSilence) {
+		if (modbusFrame[0] == modbusAddress || modbusFrame[0] == 0) {
+			modbusFrameReady = true;    // the loop has not seen it yet; this frame is lost
+			modbusLastByte = now;
+			return;
+		}
+		modbusLength = 0;
+	}
+
+	// a too long frame is kept short and then rejected by its CRC
+	if (modbusLength < sizeof(modbusFrame)) {
+		modbusFrame[modbusLength++] = b;
+	}
+	modbusLastByte = now;
+}
+
+/*
+ * The UART can take the next byte of the response. Before the last one the TX complete flag is cleared,
+ * so the TX complete interrupt comes when that byte has left.
+ */
+ISR(USART_UDRE_vect){
+	if (modbusSent == modbusResponseLength - 1) {
+		UCSR0A = (UCSR0A & (_BV(U2X0) | _BV(MPCM0))) | _BV(TXC0);
+		UCSR0B = (UCSR0B & ~_BV(UDRIE0)) | _BV(TXCIE0);
+	}
+	UDR0 = modbusFrame[modbusSent++];
+}
+
+/*
+ * The stop bit of the last byte has been sent: switch the RS-485 driver back to receiving.
+ */
+ISR(USART_TX_vect){
+	if (modbusDePin >= 0) {
+		digitalWrite(modbusDePin, LOW);
+	}
+	UCSR0B &= ~_BV(TXCIE0);
+	modbusSending = false;
+}
+#endif
+
+#if MODBUS_ENABLED
+/*
+ * Check the request in modbusFrame and send the response.
+ * Broadcast requests (address 0) are executed without a response.
+ */
+void modbusProcess(){
+
+	if (modbusLength < 8 || (modbusFrame[0] != modbusAddress && modbusFrame[0] != 0)) {
+		return;
+	}
+	if (modbusCrc(modbusFrame, modbusLength - 2) != word(modbusFrame[modbusLength - 1], modbusFrame[modbusLength - 2])) {
+		return;
+	}
+
+	byte function = modbusFrame[1];
+	unsigned int start = word(modbusFrame[2], modbusFrame[3]);
+	unsigned int count = word(modbusFrame[4], modbusFrame[5]);
+	byte exception = 0;
+	byte length = 0;
+
+	// read holding registers (settings) or input registers (the state of the controller)
+	if (function == 3 || function == 4) {
+		unsigned int registers = (function == 3) ? sizeof(defaultSettings) : modbusInputRegisters;
+
+		if (count == 0 || start >= registers || count > registers - start) {
+			exception = 2;
+		}
+		else {
+			modbusFrame[2] = count * 2;
+			for (byte i = 0; i < count; i++) {
+				unsigned int value = (function == 3) ? eepromSettings[start + i] : modbusInputRegister(start + i);
+				modbusFrame[3 + 2*i] = highByte(value);
+				modbusFrame[4 + 2*i] = lowByte(value);
+			}
+			length = 3 + count * 2;
+		}
+	}
+	// write one setting; the response repeats the request
+	else if (function == 6) {
+		exception = modbusWriteSetting(start, count);
+		length = 6;
+	}
+	// write many settings; the response repeats the start and the count
+	else if (function == 16) {
+		if (count == 0 || start >= sizeof(defaultSettings) || count > sizeof(defaultSettings) - start
+			|| modbusFrame[6] != count * 2 || modbusLength < 9 + count * 2) {
+			exception = 2;
+		}
+		// check all the values first: an exception leaves every setting as it was
+		for (byte i = 0; i < count && exception == 0; i++) {
+			exception = modbusCheckSetting(start + i, word(modbusFrame[7 + 2*i], modbusFrame[8 + 2*i]));
+		}
+		for (byte i = 0; i < count && exception == 0; i++) {
+			modbusWriteSetting(start + i, word(modbusFrame[7 + 2*i], modbusFrame[8 + 2*i]));
+		}
+		length = 6;
+	}
+	else {
+		exception = 1;
+	}
+
+	// broadcast
+	if (modbusFrame[0] == 0) {
+		return;
+	}
+
+	if (exception != 0) {
+		modbusFrame[1] = function | 0x80;
+		modbusFrame[2] = exception;
+		length = 3;
+	}
+
+	unsigned int crc = modbusCrc(modbusFrame, length);
+	modbusFrame[length++] = lowByte(crc);
+	modbusFrame[length++] = highByte(crc);
+
+	// the UDRE interrupt sends it
+	if (modbusDePin >= 0) {
+		digitalWrite(modbusDePin, HIGH);
+	}
+	modbusResponseLength = length;
+	modbusSent = 0;
+	modbusSending = true;
+	UCSR0B |= _BV(UDRIE0);
+}
+
+/*
+ * The value of an input register.
+ */
+unsigned int modbusInputRegister(byte addr){
+	switch (addr) {
+		case 0: return lastHumidity;
+		case 1: return lastTemperature;
+		case 2: return digitalRead(relayFan) == LOW;    // the relay is ON when its input is LOW
+		case 3: return fanProtect;
+		case 4: return fanBudget() / 1000;
+		case 5: return lockFan;
+		case 6: return digitalRead(ledPin) == HIGH;
+		case 7: return fanForced;
+		case 8: return sensorFailed;
+		case 9: return ambientLevel();
+		case 10: return memoryFree();
+		case 11: return memoryStackMin();
+		case 12: return memoryHeapSize();
+		case 13: return memoryFreeList();
+		case 14: return &__bss_end - &__data_start;
+		case 15: return ramSettings;
+		case 16: return ramDisplay;
+		case 17: return ramSensor;
+		case 18: return ramControl;
+		case 19: return ramTrace;
+		case 20: return ramSerial;
+		default: return min(firstDecisionTime, 65535UL);
+	}
+}
+
+/*
+ * Can the setting take the value? Returns the Modbus exception code (0 -> OK).
+ */
+byte modbusCheckSetting(unsigned int addr, unsigned int value){
+
+	if (addr >= sizeof(defaultSettings)) {
+		return 2;
+	}
+	if (value > 255 || (addr == 1 && value > maxContrast) || (addr == 3 && value > 1)) {
+		return 3;
+	}
+	return 0;
+}
+
+/*
+ * Change a setting the same way the settings menu does and have it saved to EEPROM in the background.
+ * Returns the Modbus exception code (0 -> OK).
+ */
+byte modbusWriteSetting(unsigned int addr, unsigned int value){
+	byte exception = modbusCheckSetting(addr, value);
+
+	if (exception != 0) {
+		return exception;
+	}
+
+	traceSetting(1, addr, eepromSettings[addr], value);
+	eepromSettings[addr] = value;
+	eepromDirty |= 1 << addr;
+
+	// set the light and contrast immediately
+	if (addr == 0 && light) {
+		analogWrite(bri, value);
+	}
+	else if (addr == 1) {
+		analogWrite(contrast, value);
+	}
+	return 0;
+}
+
+/*
+ * Modbus CRC-16 (polynomial 0xA001, initial value 0xFFFF).
+ */
+unsigned int modbusCrc(byte* data, byte length){
+	unsigned int crc = 0xFFFF;
+
+	for (byte i = 0; i < length; i++) {
+		crc = _crc16_update(crc, data[i]);
+	}
+	return crc;
+}
+#endif
+
+
+/*
+ * MEMORY
+ * Paint the memory between the heap and the stack (leaving the stack of setup() alone).
+ */
+void memoryPaintStack(){
+	char* p = memoryHeapEnd();
+	char* top = (char*)SP - 32;
+
+	while (p < top) {
+		*p++ = memoryPaint;
+	}
+}
+
+// the end of the heap; the free memory begins here
+char* memoryHeapEnd(){
+	return __brkval ? __brkval : &__heap_start;
+}
+
+/*
+ * Bytes free between the heap and the stack now.
+ */
+unsigned int memoryFree(){
+	return (char*)SP - memoryHeapEnd();
+}
+
+/*
+ * The smallest gap between the heap and the stack since boot: the longest run of paint left between them.
+ * Going down from the stack, what the stack has used is skipped (a memoryPaint byte in it makes a short run).
+ * free() lowers __brkval, so the bytes the heap used above it are not paint either and end the run.
+ */
+unsigned int memoryStackMin(){
+	char* p = (char*)SP;
+	char* end = memoryHeapEnd();
+	unsigned int n = 0;
+	unsigned int longest = 0;
+
+	while (p > end) {
+		p--;
+		n = ((byte)*p == memoryPaint) ? n + 1 : 0;     // char is signed
+		if (n > longest) {
+			longest = n;
+		}
+	}
+	return longest;
+}
+
+unsigned int memoryHeapSize(){
+	return memoryHeapEnd() - &__heap_start;
+}
+
+/*
+ * Bytes in the free blocks inside the heap (the String temporaries leave them behind).
+ */
+unsigned int memoryFreeList(){
+	unsigned int n = 0;
+
+	for (struct __freelist* block = __flp; block; block = block->nx) {
+		n += block->sz;
 	}
+	return n;
 }